@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Runs the same workload through the blocking and the async S3Client API at the
+# same total concurrency.
+apis=(sync async)
+
+for a in ${apis[@]}; do
+	./s3_perf --api=$a $@
+	echo ----------------------------------------
+done
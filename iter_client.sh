@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Runs the same workload through the S3Client and through presigned URLs on
+# raw libcurl, and prints the share of the raw throughput lost in the SDK.
+clients=(s3 presigned)
+
+for c in ${clients[@]}; do
+	./s3_perf --client=$c $@ | tee client_$c.log
+	echo ----------------------------------------
+done
+
+for stage in UPLOAD DOWNLOAD; do
+	sdk=$(grep "^$stage stage throughput" client_s3.log | awk '{print $4}')
+	raw=$(grep "^$stage stage throughput" client_presigned.log | awk '{print $4}')
+	if [ -n "$sdk" ] && [ -n "$raw" ]; then
+		awk -v s=$stage -v sdk=$sdk -v raw=$raw 'BEGIN {
+			printf "%s: s3 %.1f MB/sec, presigned %.1f MB/sec, SDK overhead %.1f%%\n",
+				s, sdk, raw, 100 * (raw - sdk) / raw }'
+	fi
+done
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Runs the same workload over the curl and the io_uring HTTP transport.
+# Requires a build with IO_URING=1 and an http endpoint.
+clients=(curl io_uring)
+
+for c in ${clients[@]}; do
+	./s3_perf --http_client=$c --scheme=http $@
+	echo ----------------------------------------
+done
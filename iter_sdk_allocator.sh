@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Runs the same workload with the default and the pooled SDK allocator.
+allocators=(default pool)
+
+for a in ${allocators[@]}; do
+	./s3_perf --sdk_allocator=$a $@
+	echo ----------------------------------------
+done
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Sweeps the socket buffer sizes. The effective values read back from the
+# sockets are printed with every stage report.
+buf_kb=(0 256 1024 4096 16384)
+
+for b in ${buf_kb[@]}; do
+	./s3_perf --so_sndbuf=$((b * 1024)) --so_rcvbuf=$((b * 1024)) $@
+	echo ----------------------------------------
+done
@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Starts local mock S3 endpoints, uploads and downloads through all of them
+# with --lb_policy=key_hash and checks that the objects were spread over every
+# endpoint. Each mock keeps only the objects uploaded to it, so the download
+# fails unless every key is routed to the same endpoint again.
+ports=(9100 9101 9102)
+
+export AWS_ACCESS_KEY_ID=mock AWS_SECRET_ACCESS_KEY=mock
+export AWS_EC2_METADATA_DISABLED=true
+
+pids=()
+trap 'kill ${pids[@]} 2>/dev/null' EXIT
+for p in ${ports[@]}; do
+	python3 - $p <<'EOF' &
+import http.server, sys
+
+objects = {}
+
+class Handler(http.server.BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+
+	def reply(self, code, length=0, body=True):
+		self.send_response(code)
+		self.send_header("Content-Length", str(length))
+		self.send_header("ETag", '"mock"')
+		self.end_headers()
+		if body and length:
+			self.wfile.write(b"x" * length)
+
+	def do_PUT(self):
+		length = int(self.headers.get("Content-Length", 0))
+		self.rfile.read(length)
+		objects[self.path.split("?")[0]] = length
+		self.reply(200)
+
+	def do_GET(self):
+		length = objects.get(self.path.split("?")[0])
+		self.reply(200, length) if length is not None else self.reply(404)
+
+	def do_HEAD(self):
+		length = objects.get(self.path.split("?")[0])
+		self.reply(200 if length is not None else 404, length or 0, False)
+
+	def log_message(self, *args):
+		pass
+
+http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])),
+                                Handler).serve_forever()
+EOF
+	pids+=($!)
+done
+sleep 1
+
+endpoints=$(printf "127.0.0.1:%s," ${ports[@]})
+./s3_perf --scheme=http --endpoint=${endpoints%,} --lb_policy=key_hash \
+	--stage=all --obj_size_kb=16 $@ | tee mock_endpoints.log
+if [ ${PIPESTATUS[0]} -ne 0 ]; then
+	echo "FAIL: s3_perf failed"
+	exit 1
+fi
+
+status=0
+for p in ${ports[@]}; do
+	obj=$(grep "^DOWNLOAD stage endpoint 127.0.0.1:$p:" mock_endpoints.log |
+		awk '{print $5}')
+	if [ -z "$obj" ] || [ "$obj" -eq 0 ]; then
+		echo "FAIL: no objects downloaded from 127.0.0.1:$p"
+		status=1
+	else
+		echo "127.0.0.1:$p: $obj objects"
+	fi
+done
+[ $status -eq 0 ] && echo "OK: objects spread over ${#ports[@]} endpoints"
+exit $status
@@ -8,30 +8,127 @@
 
 #include <aws/core/Aws.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
+#include <aws/core/client/CoreErrors.h>
+#include <aws/core/client/RetryStrategy.h>
+#include <aws/core/http/HttpClientFactory.h>
+#include <aws/core/http/curl/CurlHttpClient.h>
+#include <aws/core/http/standard/StandardHttpRequest.h>
+#include <aws/core/http/standard/StandardHttpResponse.h>
 #include <aws/core/utils/StringUtils.h>
+#include <aws/core/utils/threading/Executor.h>
 #include <aws/s3/S3Client.h>
 #include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#ifdef S3_PERF_CRT
+#include <aws/s3-crt/S3CrtClient.h>
+#endif
+#ifdef S3_PERF_TRANSFER
+#include <aws/transfer/TransferManager.h>
+#endif
+#include <curl/curl.h>
+#include <dirent.h>
 #include <gflags/gflags.h>
+#ifdef S3_PERF_IO_URING
+#include <liburing.h>
+#endif
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
 #include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <ifaddrs.h>
+#include <map>
 #include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <random>
+#include <sstream>
+#include <streambuf>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
 DEFINE_string(bucket_name, "ltss-test",
-              "S3 bucket name");
+              "S3 bucket name, or a comma separated list of buckets to "
+              "spread the objects over");
 
 DEFINE_string(region, "us-west-1",
               "S3 bucket region");
 
+DEFINE_string(endpoint, "",
+              "S3 endpoint as host[:port], or a comma separated list of "
+              "them to spread the requests of --client=s3 over with "
+              "--lb_policy. Empty uses the AWS endpoint of the region");
+
+DEFINE_string(lb_policy, "round_robin",
+              "Routing of requests over several endpoints: 'round_robin', "
+              "'least_outstanding', or 'key_hash' (consistent hashing of "
+              "the object key)");
+
+DEFINE_string(scheme, "https",
+              "Endpoint scheme: 'https' or 'http'");
+
+DEFINE_string(client, "s3",
+              "Client stack: 's3' (S3Client async API), 'presigned' "
+              "(presigned URLs generated ahead of the stage and driven "
+              "through one curl multi event loop per thread), 'crt' "
+              "(S3CrtClient, build with CRT=1) or 'transfer' "
+              "(TransferManager over S3Client, build with TRANSFER=1) or "
+              "'event' (presigned URLs driven by an epoll state machine per "
+              "thread with num_outstanding_req connections each, for "
+              "thousands of concurrent requests, needs --scheme=http)");
+
+DEFINE_string(api, "async",
+              "S3Client API: 'async' (PutObjectAsync/GetObjectAsync with "
+              "num_outstanding_req slots per thread) or 'sync' (blocking "
+              "PutObject/GetObject from num_outstanding_req worker threads "
+              "per thread)");
+
+DEFINE_double(crt_target_gbps, 10,
+              "Throughput target of the CRT client, which sizes its "
+              "connection pool from it");
+
+DEFINE_int32(crt_part_size_mb, 8,
+             "Part size of the CRT client in MB");
+
+DEFINE_string(http_client, "curl",
+              "SDK HTTP transport: 'curl' or 'io_uring'. 'io_uring' needs a "
+              "build with IO_URING=1, Linux 6.0+ and --scheme=http");
+
 DEFINE_string(prefix, "obj/",
               "Object name prefix. The final name is "
-              "<prefix><thread_num>_<obj_num>");
+              "<prefix><thread_num>_<obj_num>, with the partition of "
+              "--key_scheme after the prefix");
+
+DEFINE_string(key_scheme, "flat",
+              "Spreading of the keys over num_prefixes partitions: 'flat' "
+              "(one partition), 'hash' (<prefix><hex hash>/...), "
+              "'prefixes' (<prefix>p<N>/... round-robin), or 'date' "
+              "(<prefix>YYYY/MM/DD/HH/... over the last num_prefixes hours)");
+
+DEFINE_int32(num_prefixes, 16,
+             "Number of key partitions of --key_scheme other than 'flat', "
+             "at most 65536 for 'hash'");
+
+DEFINE_string(key_date, "2024-01-01T00",
+              "Newest hour, YYYY-MM-DDTHH in UTC, of the 'date' key scheme, "
+              "so that separate runs use the same keys. Empty uses the "
+              "current hour");
 
 DEFINE_int32(obj_size_kb, 1024,
              "Object size in kilobytes");
@@ -45,16 +142,201 @@ DEFINE_int32(num_objects, 100,
 DEFINE_int32(num_connections, 25,
              "Number of connections per thread");
 
+DEFINE_int32(client_shards, 0,
+             "Number of S3Clients shared by all threads, thread N using "
+             "client N % client_shards. Each client has its own pool of "
+             "num_connections connections. 0 gives every thread its own "
+             "client");
+
+DEFINE_bool(prewarm, false,
+            "Open num_connections connections per S3Client with HEAD "
+            "requests before every stage iteration, outside of its timing");
+
 DEFINE_int32(num_outstanding_req, 0,
              "Number of outstanding requests per thread. 0 makes it equal "
              "to num_connections");
 
+DEFINE_string(admission, "thread",
+              "In-flight request limit: 'thread' (num_outstanding_req per "
+              "thread) or 'global' (max_in_flight shared by all threads, "
+              "admitted in arrival order)");
+
+DEFINE_int32(max_in_flight, 0,
+             "Global in-flight limit of --admission=global. 0 makes it equal "
+             "to num_threads * num_outstanding_req");
+
+DEFINE_string(manifest, "",
+              "Dataset manifest file with the keys, sizes, content seeds "
+              "and checksums of the objects. --stage=populate creates it "
+              "from the flags unless it exists and uploads the missing "
+              "objects, --stage=download reads its objects");
+
 DEFINE_string(stage, "all",
-              "Defines the stages to test: 'upload', 'download', or 'all'");
+              "Defines the stages to test: 'upload', 'download', 'session', "
+              "or 'all'. 'all' runs the session stage between the upload and "
+              "download stages when --virtual_clients is set. 'populate' "
+              "uploads the objects of --manifest that are missing");
+
+DEFINE_int32(virtual_clients, 0,
+             "Number of closed-loop virtual clients of the session stage. "
+             "Client N works on the object N of the upload stage");
+
+DEFINE_int32(sessions_per_client, 10,
+             "Number of sessions each virtual client runs");
+
+DEFINE_string(session_ops, "get",
+              "Comma separated operations of a session: 'put' or 'get'");
+
+DEFINE_double(think_time_ms, 100,
+              "Mean think time of a virtual client before each operation");
+
+DEFINE_string(think_time_dist, "exp",
+              "Think time distribution: 'fixed', 'uniform' over [0, 2 * "
+              "mean], or 'exp' (exponential)");
 
 DEFINE_int32(count, 5,
              "Number of times each stage should be executed");
 
+DEFINE_string(local_addrs, "",
+              "Comma separated source IP addresses. Client N, a thread or a "
+              "--client_shards shard, binds its connections to address N % "
+              "count, which spreads the traffic over several NICs");
+
+DEFINE_int32(so_sndbuf, 0,
+             "SO_SNDBUF of the connections in bytes. 0 keeps the kernel "
+             "default and its autotuning");
+
+DEFINE_int32(so_rcvbuf, 0,
+             "SO_RCVBUF of the connections in bytes. 0 keeps the kernel "
+             "default and its autotuning");
+
+DEFINE_int32(tcp_nodelay, -1,
+             "TCP_NODELAY of the connections: 0 or 1. -1 keeps the HTTP "
+             "client's choice");
+
+DEFINE_string(tcp_congestion, "",
+              "TCP congestion control of the connections, e.g. 'cubic' or "
+              "'bbr'. Empty keeps the system default");
+
+DEFINE_int32(tcp_keepalive_sec, 0,
+             "Enables TCP keep-alive probes after this many idle seconds, "
+             "repeated at the same interval. 0 keeps the HTTP client's "
+             "choice");
+
+DEFINE_double(rate_limit_ops, 0,
+              "Global cap on request submissions per second across all "
+              "threads. 0 disables the limit");
+
+DEFINE_double(rate_limit_mbps, 0,
+              "Global cap on MB/sec submitted across all threads, charged "
+              "with the object size at submit time. 0 disables the limit");
+
+DEFINE_double(rate_limit_burst_ms, 100,
+              "Burst size of the rate limits, in milliseconds worth of "
+              "their rate");
+
+DEFINE_bool(read_after_write, false,
+            "Read every uploaded object right after its PUT completes, "
+            "until the read returns the new version, and report the time "
+            "to visible and the rate of stale and missing first reads. "
+            "Requires --client=s3");
+
+DEFINE_bool(read_after_write_list, false,
+            "With --read_after_write, also LIST every uploaded object until "
+            "it is listed with the new version");
+
+DEFINE_int32(read_after_write_retry_ms, 5,
+             "Delay between the reads of an object that is not visible yet");
+
+DEFINE_int32(read_after_write_timeout_ms, 10000,
+             "Time after which an object that is not visible is counted as "
+             "a timeout");
+
+DEFINE_int32(stall_timeout_sec, 0,
+             "Report the oldest in-flight requests of --client=s3 when no "
+             "request completed for N seconds. 0 disables the watchdog");
+
+DEFINE_int32(stop_timeout_sec, 30,
+             "On SIGINT or SIGTERM, stop submitting requests and wait N "
+             "seconds for the requests in flight before cancelling them, "
+             "then N more seconds before exiting without the stage reports. "
+             "A second signal exits at once");
+
+DEFINE_bool(stall_cancel, false,
+            "With --stall_timeout_sec, cancel the requests in flight for "
+            "longer than the timeout when a stall is reported. Cancelled "
+            "requests of the upload and download stages are skipped, in "
+            "the session stage they fail the run");
+
+DEFINE_double(soak_hours, 0,
+              "Soak test: repeat the iterations of the upload and download "
+              "stages for N hours instead of --count times, sample the "
+              "resources and throughput of the process and report their "
+              "trends. 0 disables the soak test");
+
+DEFINE_int32(soak_sample_sec, 60,
+             "Interval between the samples of the soak test");
+
+DEFINE_double(soak_trend_pct, 10,
+              "Flag a leak or decay when a sampled value grows, or the "
+              "throughput drops, by more than N% over the soak test");
+
+DEFINE_string(soak_checkpoint, "s3_perf_soak.txt",
+              "File the soak test summary and samples are written to after "
+              "every sample. Empty disables the checkpoints");
+
+DEFINE_int32(conn_sample_ms, 200,
+             "Interval between the samples of the open connections of every "
+             "stage iteration, which scan /proc/net/tcp and tcp6. Their CPU "
+             "time is left out of the CPU per object. 0 disables the "
+             "sampling");
+
+DEFINE_int32(report_interval_sec, 0,
+             "Print throughput every N seconds while a stage iteration is "
+             "running. 0 disables interval reports");
+
+DEFINE_bool(sys_stats, false,
+            "Sample /proc/net/dev, /proc/net/snmp, /proc/stat and "
+            "/proc/meminfo with every interval report and flag likely "
+            "bottlenecks. Implies report_interval_sec=1 if it is not set");
+
+DEFINE_string(sdk_allocator, "default",
+              "SDK memory manager: 'default' (malloc) or 'pool' (size-class "
+              "pools with per-thread caches). 'pool' requires an SDK built "
+              "with -DCUSTOM_MEMORY_MANAGEMENT=ON");
+
+DEFINE_bool(alloc_profile, false,
+            "Count SDK allocations per request lifecycle stage and report "
+            "allocations and bytes per object for each stage. Adds an atomic "
+            "increment to every allocation. Requires an SDK built with "
+            "-DCUSTOM_MEMORY_MANAGEMENT=ON");
+
+DEFINE_string(huge_pages, "none",
+              "Page size backing the payload and receive buffers: 'none', "
+              "'thp' (madvise(MADV_HUGEPAGE)), '2m' or '1g' (MAP_HUGETLB, "
+              "needs pages reserved in /proc/sys/vm/nr_hugepages or "
+              "/sys/kernel/mm/hugepages). Anything but 'none' also uploads "
+              "straight from the payload buffer and downloads into "
+              "preallocated per-thread receive buffers");
+
+DEFINE_bool(prefault, false,
+            "Touch every page of the payload and receive buffers before the "
+            "stages start. Implies the preallocated buffers of huge_pages");
+
+DEFINE_int32(recv_buffer_spares, 0,
+             "Receive buffers per download thread on top of one per "
+             "outstanding request, for the responses the SDK releases "
+             "shortly after their slot. Responses that find no free buffer "
+             "are read into unprefaulted streams");
+
+DEFINE_string(nic, "",
+              "Network interface watched by sys_stats. Empty sums all "
+              "interfaces except loopback");
+
+DEFINE_int32(nic_speed_mbps, 0,
+             "NIC line rate in Mbit/s used to flag saturation. 0 reads "
+             "/sys/class/net/<nic>/speed");
+
 //-----------------------------------------------------------------------------
 
 using namespace google;
@@ -64,278 +346,5812 @@ using namespace std::chrono;
 // Data chunk to upload.
 static Aws::String g_obj;
 
-//-----------------------------------------------------------------------------
+// Objects and bytes completed since the start of the program. Sampled by
+// IntervalReporter.
+static atomic<int64_t> g_done_obj{0};
+static atomic<int64_t> g_done_bytes{0};
 
-static void InitChunk() {
-  // Create a chunk filled with random numbers.
-  random_device rd;
-  mt19937 gen(rd());
-  uniform_int_distribution<> dis(0, 255);
+// Signal that asked the program to stop, or 0.
+static atomic<int> g_stop_signal{0};
 
-  g_obj.resize(FLAGS_obj_size_kb * 1024);
-  for (int ii = 0; ii < FLAGS_obj_size_kb * 1024; ++ii) {
-    g_obj[ii] = (char)dis(gen);
-  }
+// True once SIGINT or SIGTERM was received. The stages then stop submitting
+// requests, drain the ones in flight and report what they completed.
+static bool Stopping() {
+  return g_stop_signal.load(memory_order_relaxed) != 0;
 }
 
-static void PrintVars() {
-  // Print all the gflags.
-  cout << "Test configuration:" << endl;
-  vector<CommandLineFlagInfo> vec;
-  GetAllFlags(&vec);
-  for (const auto& v : vec) {
-    if (v.filename.find(__FILE__) != string::npos) {
-      cout << "  " << v.name << " = " << v.current_value << " " << endl;
-    }
+// Body bytes sent and received so far, counted as they move by the data
+// sent and received handlers. Sharded over the threads so that concurrent
+// transfers don't contend on a cache line.
+struct alignas(64) ByteCounter {
+  atomic<int64_t> bytes{0};
+};
+static constexpr int kNumByteCounters = 64;
+static ByteCounter g_moved_bytes[kNumByteCounters];
+static atomic<int> g_next_byte_counter{0};
+
+static void AddMovedBytes(int64_t bytes) {
+  static thread_local ByteCounter *counter =
+    &g_moved_bytes[g_next_byte_counter++ % kNumByteCounters];
+  counter->bytes.fetch_add(bytes, memory_order_relaxed);
+}
+
+static int64_t MovedBytes() {
+  int64_t bytes = 0;
+  for (const ByteCounter& counter : g_moved_bytes) {
+    bytes += counter.bytes.load(memory_order_relaxed);
   }
-  cout << endl;
+  return bytes;
 }
 
-static Aws::String GetObjPrefix(int thread_num) {
-  return Aws::String(FLAGS_prefix.c_str(), FLAGS_prefix.size()) +
-    Aws::Utils::StringUtils::to_string(thread_num) + "_";
+// Whether the driver of --client counts the bytes as they move. The CRT and
+// TransferManager clients only account completed objects.
+static bool CountsMovedBytes() {
+  return FLAGS_client == "s3" || FLAGS_client == "presigned" ||
+    FLAGS_client == "event";
 }
 
-class ReportDuration {
+//-----------------------------------------------------------------------------
+// Payload and receive buffers
+//-----------------------------------------------------------------------------
+
+static bool UsePageBuffers() {
+  return FLAGS_huge_pages != "none" || FLAGS_prefault;
+}
+
+// Resource usage of the process from getrusage().
+struct ProcUsage {
+  int64_t minor_faults = 0;
+  int64_t major_faults = 0;
+  double user_sec = 0;
+  double sys_sec = 0;
+  int64_t voluntary_csw = 0;
+  int64_t involuntary_csw = 0;
+};
+
+// CPU time of the finished sampling threads, which is not part of the
+// measured workload.
+static atomic<int64_t> g_sampler_user_us{0};
+static atomic<int64_t> g_sampler_sys_us{0};
+
+// Adds the CPU time of the calling thread to the sampler CPU time. Called by
+// sampling threads right before they exit.
+static void AddSamplerCpu() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  g_sampler_user_us +=
+    (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+  g_sampler_sys_us +=
+    (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+}
+
+// Resources of the process, without the CPU time of the sampling threads.
+static ProcUsage GetProcUsage() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  ProcUsage proc;
+  proc.minor_faults = usage.ru_minflt;
+  proc.major_faults = usage.ru_majflt;
+  proc.user_sec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 -
+    g_sampler_user_us / 1e6;
+  proc.sys_sec = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 -
+    g_sampler_sys_us / 1e6;
+  proc.voluntary_csw = usage.ru_nvcsw;
+  proc.involuntary_csw = usage.ru_nivcsw;
+  return proc;
+}
+
+// Anonymous memory mapping backed by the pages selected by
+// FLAGS_huge_pages.
+class PageBuffer {
  public:
-  ReportDuration(const string& operation,
-                 int num_threads,
-                 int obj_per_thread,
-                 int obj_size_kb)
-  : operation_(operation), num_threads_(num_threads),
-    obj_per_thread_(obj_per_thread), obj_size_kb_(obj_size_kb) {
+  explicit PageBuffer(size_t size) {
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t page_size = 4096;
+    if (FLAGS_huge_pages == "2m") {
+      flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+      page_size = 1 << 21;
+    } else if (FLAGS_huge_pages == "1g") {
+      flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+      page_size = 1 << 30;
+    } else if (FLAGS_huge_pages == "thp") {
+      page_size = 1 << 21;
+    } else if (FLAGS_huge_pages != "none") {
+      cerr << "ERROR: invalid --huge_pages " << FLAGS_huge_pages << endl;
+      exit(1);
+    }
+    size_ = max<size_t>(size, 1);
+    mapped_size_ = (size_ + page_size - 1) / page_size * page_size;
+    void *addr = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, flags,
+                      -1, 0);
+    if (addr == MAP_FAILED) {
+      cerr << "ERROR: failed to map " << mapped_size_ << " bytes with "
+           << "--huge_pages=" << FLAGS_huge_pages << ": " << strerror(errno)
+           << endl;
+      exit(1);
+    }
+    if (FLAGS_huge_pages == "thp") {
+      madvise(addr, mapped_size_, MADV_HUGEPAGE);
+    }
+    data_ = static_cast<char *>(addr);
+  }
 
-    cout << operation << " starting" << endl;
-    t0_ = high_resolution_clock::now();
+  ~PageBuffer() {
+    munmap(data_, mapped_size_);
   }
 
-  ~ReportDuration() {
-    high_resolution_clock::time_point t1 = high_resolution_clock::now();
-    double time_sec = duration_cast<duration<double>>(t1 - t0_).count();
-    int num_obj = num_threads_ * obj_per_thread_;
-    double total_size_mb = (double)obj_size_kb_ * num_obj / 1024;
-    cout << operation_ << " completed in " << time_sec << " seconds (total: "
-         << num_obj << " objects, " << total_size_mb << " MB)" << endl
-         << operation_ << " throughput: " << (total_size_mb / time_sec)
-         << " MB/sec, " << (num_obj / time_sec) << " obj/sec" << endl << endl;
-    fflush(stdout);
+  char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  void Prefault() {
+    for (size_t off = 0; off < mapped_size_; off += 4096) {
+      data_[off] = 0;
+    }
   }
 
  private:
-  const string operation_;
-  const int num_threads_, obj_per_thread_, obj_size_kb_;
-  high_resolution_clock::time_point t0_;
+  char *data_;
+  size_t size_;
+  size_t mapped_size_;
 };
 
-class Ctx : public Aws::Client::AsyncCallerContext {
+// Stream buffer over caller-owned memory, used instead of Aws::StringStream
+// so that the payload is not copied for every request.
+class MemStreamBuf : public streambuf {
  public:
-  void GetAvailableSlot() {
-    unique_lock<mutex> lck(mtx_);
-    if (num_outstanding_req_ >= FLAGS_num_outstanding_req) {
-      // No slots available, wait for one.
-      cond_.wait(lck);
-    }
-    assert(num_outstanding_req_ < FLAGS_num_outstanding_req);
-    ++num_outstanding_req_;
+  MemStreamBuf(char *data, size_t size) {
+    setg(data, data, data + size);
+    setp(data, data + size);
   }
 
-  void ReleaseSlot() const {
-    unique_lock<mutex> lck(mtx_);
-    assert(num_outstanding_req_ > 0);
-    --num_outstanding_req_;
-    cond_.notify_one();
+ protected:
+  pos_type seekoff(off_type off,
+                   ios_base::seekdir dir,
+                   ios_base::openmode which) override {
+    char *const begin = eback();
+    char *const end = egptr();
+    char *cur = (which & ios_base::in) ? gptr() : pptr();
+    char *pos = dir == ios_base::beg ? begin : dir == ios_base::end ? end :
+                cur;
+    pos += off;
+    if (pos < begin || pos > end) {
+      return pos_type(off_type(-1));
+    }
+    if (which & ios_base::in) {
+      setg(begin, pos, end);
+    }
+    if (which & ios_base::out) {
+      setp(begin, end);
+      for (off_type left = pos - begin; left > 0; ) {
+        const int step = min<off_type>(left, INT32_MAX);
+        pbump(step);
+        left -= step;
+      }
+    }
+    return pos_type(pos - begin);
   }
 
-  void WaitAll() {
-    // Wait for all outstanding requests to complete.
-    unique_lock<mutex> lck(mtx_);
-    while (num_outstanding_req_ > 0) {
-      cond_.wait(lck);
-    }
+  pos_type seekpos(pos_type pos, ios_base::openmode which) override {
+    return seekoff(off_type(pos), ios_base::beg, which);
   }
+};
+
+class MemStream : public Aws::IOStream {
+ public:
+  MemStream(char *data, size_t size)
+  : Aws::IOStream(&buf_), buf_(data, size) {}
 
  private:
-  mutable mutex mtx_;
-  mutable condition_variable cond_;
-  mutable int num_outstanding_req_{0};
+  MemStreamBuf buf_;
 };
 
-//-----------------------------------------------------------------------------
-// Upload
-//-----------------------------------------------------------------------------
+// Preallocated receive buffers of one download thread. Acquire() is the
+// response stream factory of the GET requests; the slot is returned when the
+// SDK deletes the stream.
+class RecvBufferPool {
+ public:
+  RecvBufferPool(int num_slots, size_t slot_size)
+  : slot_size_((slot_size + 4095) / 4096 * 4096),
+    buf_(slot_size_ * num_slots) {
 
-static void ObjUploadDone(
-  const Aws::S3::S3Client *client,
-  const Aws::S3::Model::PutObjectRequest& request,
-  const Aws::S3::Model::PutObjectOutcome& outcome,
-  const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+    for (int ii = num_slots - 1; ii >= 0; --ii) {
+      free_slots_.push_back(ii);
+    }
+  }
 
-  if (!outcome.IsSuccess()) {
-    auto error = outcome.GetError();
-    cerr << "ERROR: " << error.GetExceptionName() << ": "
-      << error.GetMessage() << endl;
-    exit(1);
+  Aws::IOStream *Acquire() {
+    int slot = -1;
+    {
+      lock_guard<mutex> lck(mtx_);
+      if (!free_slots_.empty()) {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+      }
+    }
+    if (slot < 0) {
+      // The previous response of a just released Ctx slot may not be
+      // destroyed yet.
+      ++num_fallbacks_;
+      return Aws::New<Aws::StringStream>("s3_perf");
+    }
+    return Aws::New<SlotStream>("s3_perf", this, slot);
   }
 
-  dynamic_pointer_cast<const Ctx>(context)->ReleaseSlot();
-}
+  void Prefault() {
+    buf_.Prefault();
+  }
 
-static void UploadThread(const int thread_num) {
-  Aws::Client::ClientConfiguration clientConfig;
-  //clientConfig.followRedirects = true;
-  clientConfig.region = FLAGS_region.c_str();
-  clientConfig.maxConnections = FLAGS_num_connections;
+  size_t size() const { return buf_.size(); }
+  int64_t num_fallbacks() const { return num_fallbacks_; }
 
-  Aws::S3::S3Client s3_client(clientConfig);
-  const Aws::String s3_bucket_name = FLAGS_bucket_name.c_str();
-  const Aws::String obj_name_prefix = GetObjPrefix(thread_num);
+ private:
+  class SlotStream : public MemStream {
+   public:
+    SlotStream(RecvBufferPool *pool, int slot)
+    : MemStream(pool->buf_.data() + slot * pool->slot_size_,
+                pool->slot_size_),
+      pool_(pool), slot_(slot) {}
 
-  shared_ptr<Aws::Client::AsyncCallerContext> aws_ctx = make_shared<Ctx>();
-  Ctx& ctx = *dynamic_cast<Ctx *>(aws_ctx.get());
+    ~SlotStream() {
+      lock_guard<mutex> lck(pool_->mtx_);
+      pool_->free_slots_.push_back(slot_);
+    }
 
-  // Upload objects.
-  for (int ii = 0; ii < FLAGS_num_objects; ++ii) {
-    Aws::S3::Model::PutObjectRequest object_request;
-    shared_ptr<Aws::IOStream> input_data =
-      Aws::MakeShared<Aws::StringStream>("TestTag", g_obj);
+   private:
+    RecvBufferPool *const pool_;
+    const int slot_;
+  };
 
-    object_request.SetBucket(s3_bucket_name);
-    object_request.SetKey(
-      obj_name_prefix + Aws::Utils::StringUtils::to_string(ii));
+  const size_t slot_size_;
+  PageBuffer buf_;
+  mutex mtx_;
+  vector<int> free_slots_;
+  atomic<int64_t> num_fallbacks_{0};
+};
 
-    object_request.SetBody(input_data);
+// Payload buffer used instead of g_obj with UsePageBuffers().
+static unique_ptr<PageBuffer> g_payload;
 
-    ctx.GetAvailableSlot();
+// Receive buffers per download thread, with UsePageBuffers().
+static vector<unique_ptr<RecvBufferPool>> g_recv_pools;
 
-    // Put the object.
-    s3_client.PutObjectAsync(object_request, ObjUploadDone, aws_ctx);
+// Responses that found no free receive buffer in their thread's pool.
+static int64_t RecvBufferFallbacks() {
+  int64_t fallbacks = 0;
+  for (const auto& pool : g_recv_pools) {
+    fallbacks += pool->num_fallbacks();
   }
+  return fallbacks;
+}
 
-  ctx.WaitAll();
+static int64_t ObjSize() {
+  return (int64_t)FLAGS_obj_size_kb * 1024;
 }
 
-static void Upload(const int iteration) {
-  vector<thread *> threads;
-  ReportDuration report(string("  [") + to_string(iteration) + "] UPLOAD",
-                        FLAGS_num_threads,
-                        FLAGS_num_objects,
-                        FLAGS_obj_size_kb);
+static shared_ptr<Aws::IOStream> MakePayloadStream() {
+  if (g_payload) {
+    return Aws::MakeShared<MemStream>("TestTag", g_payload->data(),
+                                      ObjSize());
+  }
+  return Aws::MakeShared<Aws::StringStream>("TestTag", g_obj);
+}
 
-  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
-    threads.push_back(new thread(UploadThread, ii));
+// Allocates the payload buffer and the receive buffers of all download
+// threads before the timed stages start, and prefaults them if requested.
+static void InitPageBuffers() {
+  if (!UsePageBuffers() || FLAGS_stage == "populate") {
+    return;
   }
-  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
-    threads[ii]->join();
-    delete threads[ii];
+  const ProcUsage proc0 = GetProcUsage();
+  const high_resolution_clock::time_point t0 = high_resolution_clock::now();
+  size_t total_size = 0;
+  if (FLAGS_stage != "download") {
+    g_payload.reset(new PageBuffer(ObjSize()));
+    if (FLAGS_prefault) {
+      g_payload->Prefault();
+    }
+    total_size += g_payload->size();
+  }
+  if (FLAGS_recv_buffer_spares < 0) {
+    cerr << "ERROR: --recv_buffer_spares must not be negative" << endl;
+    exit(1);
+  }
+  // With --admission=global one thread may hold all the in-flight slots.
+  const int recv_slots =
+    (FLAGS_admission == "global" ? FLAGS_max_in_flight :
+     FLAGS_num_outstanding_req) + FLAGS_recv_buffer_spares;
+  if (FLAGS_stage != "upload") {
+    for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+      g_recv_pools.emplace_back(new RecvBufferPool(recv_slots, ObjSize()));
+      if (FLAGS_prefault) {
+        g_recv_pools.back()->Prefault();
+      }
+      total_size += g_recv_pools.back()->size();
+    }
+  }
+  const double time_sec = duration_cast<duration<double>>(
+    high_resolution_clock::now() - t0).count();
+  const ProcUsage proc1 = GetProcUsage();
+  cout << "Buffers: " << (total_size / 1048576.0) << " MB allocated"
+       << (FLAGS_prefault ? " and prefaulted" : "") << " in " << time_sec
+       << " seconds";
+  if (!g_recv_pools.empty()) {
+    cout << ", " << recv_slots << " receive buffers per thread";
   }
+  cout << ", page faults: minor "
+       << (proc1.minor_faults - proc0.minor_faults) << ", major "
+       << (proc1.major_faults - proc0.major_faults) << endl << endl;
 }
 
-//-----------------------------------------------------------------------------
-// Download
 //-----------------------------------------------------------------------------
 
-static void ObjDownloadDone(
-  const Aws::S3::S3Client *client,
-  const Aws::S3::Model::GetObjectRequest& request,
-  const Aws::S3::Model::GetObjectOutcome& outcome,
-  const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+static void InitChunk() {
+  // Create a chunk filled with random numbers.
+  random_device rd;
+  mt19937 gen(rd());
+  uniform_int_distribution<> dis(0, 255);
 
-  if (!outcome.IsSuccess()) {
-    auto error = outcome.GetError();
-    cerr << "ERROR: " << error.GetExceptionName() << ": "
-      << error.GetMessage() << endl;
-    exit(1);
+  char *data;
+  if (g_payload) {
+    data = g_payload->data();
+  } else {
+    g_obj.resize(ObjSize());
+    data = &g_obj[0];
   }
+  for (int64_t ii = 0; ii < ObjSize(); ++ii) {
+    data[ii] = (char)dis(gen);
+  }
+}
 
-  if (outcome.GetResult().GetContentLength() != FLAGS_obj_size_kb * 1024) {
-    cerr << "ERROR: invalid object size "
-         << outcome.GetResult().GetContentLength()
-         << ", expected " << (FLAGS_obj_size_kb * 1024) << " bytes" << endl;
-    exit(1);
+static void PrintVars() {
+  // Print all the gflags.
+  cout << "Test configuration:" << endl;
+  vector<CommandLineFlagInfo> vec;
+  GetAllFlags(&vec);
+  for (const auto& v : vec) {
+    if (v.filename.find(__FILE__) != string::npos) {
+      cout << "  " << v.name << " = " << v.current_value << " " << endl;
+    }
   }
+  cout << endl;
+}
 
-  dynamic_pointer_cast<const Ctx>(context)->ReleaseSlot();
+// FNV-1a with the splitmix64 finalizer, which spreads keys that differ only
+// in their last characters. Stable across runs and builds unlike std::hash.
+static uint64_t HashKey(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t ii = 0; ii < size; ++ii) {
+    hash = (hash ^ (uint8_t)data[ii]) * 1099511628211ull;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
 }
 
-static void DownloadThread(const int thread_num) {
-  Aws::Client::ClientConfiguration clientConfig;
-  //clientConfig.followRedirects = true;
-  clientConfig.region = FLAGS_region.c_str();
-  clientConfig.maxConnections = FLAGS_num_connections;
+//-----------------------------------------------------------------------------
+// Object naming
+//-----------------------------------------------------------------------------
 
-  Aws::S3::S3Client s3_client(clientConfig);
-  const Aws::String s3_bucket_name = FLAGS_bucket_name.c_str();
-  const Aws::String obj_name_prefix = GetObjPrefix(thread_num);
+// Buckets parsed from --bucket_name.
+static vector<Aws::String> g_buckets;
 
-  shared_ptr<Aws::Client::AsyncCallerContext> aws_ctx = make_shared<Ctx>();
-  Ctx& ctx = *dynamic_cast<Ctx *>(aws_ctx.get());
+// Key prefixes of the --key_scheme partitions within a bucket.
+static vector<Aws::String> g_key_prefixes;
 
-  // Upload objects.
-  for (int ii = 0; ii < FLAGS_num_objects; ++ii) {
-    Aws::S3::Model::GetObjectRequest object_request;
-    object_request.SetBucket(s3_bucket_name);
-    object_request.SetKey(
-      obj_name_prefix + Aws::Utils::StringUtils::to_string(ii));
+// Requests and throttled requests of a (bucket, key prefix) partition.
+struct PartitionStats {
+  atomic<int64_t> requests{0};
+  atomic<int64_t> throttled{0};
+};
+static vector<unique_ptr<PartitionStats>> g_partition_stats;
 
-    ctx.GetAvailableSlot();
+static void InitKeyScheme() {
+  istringstream in(FLAGS_bucket_name);
+  string bucket;
+  while (getline(in, bucket, ',')) {
+    g_buckets.emplace_back(bucket.c_str());
+  }
+  if (g_buckets.empty()) {
+    cerr << "ERROR: no --bucket_name" << endl;
+    exit(1);
+  }
 
-    // Put the object.
-    s3_client.GetObjectAsync(object_request, ObjDownloadDone, aws_ctx);
+  const int num_prefixes =
+    FLAGS_key_scheme == "flat" ? 1 : max(FLAGS_num_prefixes, 1);
+  // The date paths are fixed by --key_date, or at startup, so the stages
+  // agree on the keys.
+  time_t newest = time(nullptr);
+  if (FLAGS_key_scheme == "date" && !FLAGS_key_date.empty()) {
+    struct tm tm = {};
+    char end;
+    if (sscanf(FLAGS_key_date.c_str(), "%4d-%2d-%2dT%2d%c", &tm.tm_year,
+               &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &end) != 4) {
+      cerr << "ERROR: invalid --key_date " << FLAGS_key_date << endl;
+      exit(1);
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    newest = timegm(&tm);
+  }
+  for (int ii = 0; ii < num_prefixes; ++ii) {
+    string prefix = FLAGS_prefix;
+    if (FLAGS_key_scheme == "hash") {
+      // Spread the hex prefixes over the whole range, so the first digit
+      // varies first.
+      char hex[8];
+      snprintf(hex, sizeof(hex), "%04x/",
+               (unsigned)((int64_t)ii * 0x10000 / num_prefixes));
+      prefix += hex;
+    } else if (FLAGS_key_scheme == "prefixes") {
+      prefix += "p" + to_string(ii) + "/";
+    } else if (FLAGS_key_scheme == "date") {
+      const time_t hour = newest - (time_t)ii * 3600;
+      struct tm tm;
+      gmtime_r(&hour, &tm);
+      char path[32];
+      strftime(path, sizeof(path), "%Y/%m/%d/%H/", &tm);
+      prefix += path;
+    }
+    g_key_prefixes.emplace_back(prefix.c_str());
   }
+}
 
-  ctx.WaitAll();
+static void InitPartitionStats() {
+  for (size_t ii = 0; ii < g_buckets.size() * g_key_prefixes.size(); ++ii) {
+    g_partition_stats.emplace_back(new PartitionStats());
+  }
 }
 
-static void Download(const int iteration) {
-  vector<thread *> threads;
-  ReportDuration report(string("  [") + to_string(iteration) + "] DOWNLOAD",
-                        FLAGS_num_threads,
-                        FLAGS_num_objects,
-                        FLAGS_obj_size_kb);
+// Object of the dataset manifest, in bucket PartitionBucket(partition).
+struct ManifestEntry {
+  int partition;
+  int64_t size;
+  uint64_t seed;
+  // Of the content generated from 'seed', 0 until the object is uploaded.
+  uint64_t checksum;
+  Aws::String key;
+};
 
-  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
-    threads.push_back(new thread(DownloadThread, ii));
+// Objects of --manifest, which replace the objects named by the flags.
+static vector<ManifestEntry> g_manifest;
+
+// The threads take the manifest objects in turn, and wrap around if they
+// read more objects than it has.
+static const ManifestEntry *ManifestObj(int thread_num, int obj_num) {
+  if (g_manifest.empty()) {
+    return nullptr;
   }
-  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
-    threads[ii]->join();
-    delete threads[ii];
+  const int64_t index = (int64_t)thread_num * FLAGS_num_objects + obj_num;
+  return &g_manifest[index % g_manifest.size()];
+}
+
+// Returns the partition, bucket * num_prefixes + prefix, of an object.
+static int ObjPartition(int thread_num, int obj_num) {
+  if (const ManifestEntry *entry = ManifestObj(thread_num, obj_num)) {
+    return entry->partition;
+  }
+  const int num_prefixes = g_key_prefixes.size();
+  const int64_t index = (int64_t)thread_num * FLAGS_num_objects + obj_num;
+  int prefix = index % num_prefixes;
+  if (FLAGS_key_scheme == "hash") {
+    const string name = to_string(thread_num) + "_" + to_string(obj_num);
+    prefix = HashKey(name.data(), name.size()) % num_prefixes;
   }
+  const int bucket = index / num_prefixes % g_buckets.size();
+  return bucket * num_prefixes + prefix;
 }
 
-//-----------------------------------------------------------------------------
+static const Aws::String& PartitionBucket(int partition) {
+  return g_buckets[partition / g_key_prefixes.size()];
+}
 
-int main(int argc, char** argv) {
-  ParseCommandLineFlags(&argc, &argv, false);
-  if (FLAGS_num_outstanding_req <= 0) {
-    FLAGS_num_outstanding_req = FLAGS_num_connections;
-  }
+static const Aws::String& ObjBucket(int thread_num, int obj_num) {
+  return PartitionBucket(ObjPartition(thread_num, obj_num));
+}
 
-  Aws::SDKOptions options;
-  //options.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Trace;
-  Aws::InitAPI(options);
+static Aws::String ObjKey(int thread_num, int obj_num) {
+  if (const ManifestEntry *entry = ManifestObj(thread_num, obj_num)) {
+    return entry->key;
+  }
+  const int partition = ObjPartition(thread_num, obj_num);
+  return g_key_prefixes[partition % g_key_prefixes.size()] +
+    Aws::Utils::StringUtils::to_string(thread_num) + "_" +
+    Aws::Utils::StringUtils::to_string(obj_num);
+}
 
-  PrintVars();
+// Partition of the request the thread is sending, set by the request signed
+// handler of SetRequestHandlers() right before each HTTP attempt.
+static thread_local int t_partition = -1;
 
-  if (FLAGS_stage != "download") {
-    ReportDuration report("UPLOAD stage",
-                          FLAGS_num_threads,
-                          FLAGS_num_objects * FLAGS_count,
-                          FLAGS_obj_size_kb);
-    for (int ii = 1; ii <= FLAGS_count; ++ii) {
+// Accounts an HTTP attempt of the thread's request to its partition. S3
+// answers 503 SlowDown, and compatible stores 429, when they throttle.
+static void RecordPartitionAttempt(const Aws::Http::HttpResponse& response) {
+  if (t_partition < 0) {
+    return;
+  }
+  PartitionStats *stats = g_partition_stats[t_partition].get();
+  ++stats->requests;
+  const Aws::Http::HttpResponseCode code = response.GetResponseCode();
+  if (code == Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE ||
+      code == Aws::Http::HttpResponseCode::TOO_MANY_REQUESTS) {
+    ++stats->throttled;
+  }
+  t_partition = -1;
+}
+
+//-----------------------------------------------------------------------------
+// SDK memory management
+//-----------------------------------------------------------------------------
+
+// Memory manager for the SDK with power-of-two size classes from 16 bytes to
+// 64 KB. Freed blocks go to a per-thread cache, which spills half of its
+// blocks to a shared depot when it grows too large and refills from the depot
+// in batches. Larger or over-aligned blocks go straight to malloc.
+class PoolMemorySystem : public Aws::Utils::Memory::MemorySystemInterface {
+ public:
+  static constexpr int kNumClasses = 13;
+  static constexpr int kLargeClass = kNumClasses;
+
+  struct Stats {
+    uint64_t allocs[kNumClasses + 1] = {0};
+    uint64_t bytes[kNumClasses + 1] = {0};
+    // Allocations served without calling malloc.
+    uint64_t pool_hits = 0;
+
+    uint64_t TotalAllocs() const {
+      uint64_t total = 0;
+      for (int ii = 0; ii <= kNumClasses; ++ii) {
+        total += allocs[ii];
+      }
+      return total;
+    }
+
+    uint64_t TotalBytes() const {
+      uint64_t total = 0;
+      for (int ii = 0; ii <= kNumClasses; ++ii) {
+        total += bytes[ii];
+      }
+      return total;
+    }
+  };
+
+  static size_t ClassSize(int cls) { return size_t(16) << cls; }
+
+  void Begin() override {}
+  void End() override {}
+
+  void* AllocateMemory(size_t size,
+                       size_t alignment,
+                       const char *allocation_tag) override {
+    ThreadCache *cache = GetCache();
+    int cls = 0;
+    while (cls < kNumClasses && ClassSize(cls) < size) {
+      ++cls;
+    }
+    if (alignment > sizeof(Header)) {
+      cls = kLargeClass;
+    }
+    if (cache) {
+      Bump(&cache->allocs[cls], 1);
+      Bump(&cache->bytes[cls], size);
+    } else {
+      lock_guard<mutex> lck(retired_mtx_);
+      ++retired_.allocs[cls];
+      retired_.bytes[cls] += size;
+    }
+
+    if (cls == kLargeClass) {
+      alignment = max(alignment, sizeof(Header));
+      char *base = static_cast<char *>(malloc(size + alignment +
+                                              sizeof(Header)));
+      if (!base) {
+        return nullptr;
+      }
+      const uintptr_t addr = reinterpret_cast<uintptr_t>(base) +
+                             sizeof(Header) + alignment - 1;
+      char *ptr = reinterpret_cast<char *>(addr - addr % alignment);
+      Header *hdr = reinterpret_cast<Header *>(ptr) - 1;
+      hdr->base = base;
+      hdr->cls = kLargeClass;
+      return ptr;
+    }
+
+    FreeBlock *block = cache ? Pop(cache, cls) : PopDepot(cls);
+    Header *hdr;
+    if (block) {
+      hdr = reinterpret_cast<Header *>(block);
+      if (cache) {
+        Bump(&cache->pool_hits, 1);
+      }
+    } else {
+      hdr = static_cast<Header *>(malloc(sizeof(Header) + ClassSize(cls)));
+      if (!hdr) {
+        return nullptr;
+      }
+      hdr->base = hdr;
+      hdr->cls = cls;
+    }
+    return hdr + 1;
+  }
+
+  void FreeMemory(void *ptr) override {
+    if (!ptr) {
+      return;
+    }
+    Header *hdr = static_cast<Header *>(ptr) - 1;
+    if (hdr->cls == kLargeClass) {
+      free(hdr->base);
+      return;
+    }
+    FreeBlock *block = reinterpret_cast<FreeBlock *>(hdr);
+    ThreadCache *cache = GetCache();
+    if (!cache) {
+      PushDepot(hdr->cls, block, block, 1);
+      return;
+    }
+    block->next = cache->free[hdr->cls];
+    cache->free[hdr->cls] = block;
+    if (++cache->count[hdr->cls] > MaxCached(hdr->cls)) {
+      Spill(cache, hdr->cls);
+    }
+  }
+
+  // Returns the allocation counters summed over all threads, including the
+  // ones that already exited.
+  Stats GetStats() const {
+    lock_guard<mutex> lck(retired_mtx_);
+    Stats stats = retired_;
+    for (const ThreadCache *cache : caches_) {
+      Accumulate(*cache, &stats);
+    }
+    return stats;
+  }
+
+ private:
+  // Precedes every block. Keeps the payload 16-byte aligned.
+  struct Header {
+    void *base;
+    int64_t cls;
+  };
+  static_assert(sizeof(Header) == 16, "unexpected header size");
+
+  struct FreeBlock {
+    FreeBlock *next;
+    // Header::cls, preserved while the block is on a free list.
+    int64_t cls;
+  };
+
+  struct ThreadCache {
+    PoolMemorySystem *owner = nullptr;
+    FreeBlock *free[kNumClasses] = {nullptr};
+    int count[kNumClasses] = {0};
+    // Written only by the owning thread and read by GetStats().
+    atomic<uint64_t> allocs[kNumClasses + 1];
+    atomic<uint64_t> bytes[kNumClasses + 1];
+    atomic<uint64_t> pool_hits{0};
+
+    ThreadCache() {
+      for (int ii = 0; ii <= kNumClasses; ++ii) {
+        allocs[ii] = 0;
+        bytes[ii] = 0;
+      }
+    }
+
+    ~ThreadCache() {
+      if (owner) {
+        owner->Retire(this);
+      }
+    }
+  };
+
+  // Batch size for moving blocks between the thread caches and the depot.
+  static constexpr int kBatch = 32;
+
+  static int MaxCached(int cls) {
+    // Up to 1 MB per size class and thread.
+    return max<int>(2 * kBatch, (1 << 20) / ClassSize(cls));
+  }
+
+  static void Bump(atomic<uint64_t> *counter, uint64_t val) {
+    counter->store(counter->load(memory_order_relaxed) + val,
+                   memory_order_relaxed);
+  }
+
+  static void Accumulate(const ThreadCache& cache, Stats *stats) {
+    for (int ii = 0; ii <= kNumClasses; ++ii) {
+      stats->allocs[ii] += cache.allocs[ii].load(memory_order_relaxed);
+      stats->bytes[ii] += cache.bytes[ii].load(memory_order_relaxed);
+    }
+    stats->pool_hits += cache.pool_hits.load(memory_order_relaxed);
+  }
+
+  ThreadCache *GetCache() {
+    // The SDK may still free memory from thread-local destructors that run
+    // after the cache is gone, so fall back to the depot then.
+    static thread_local bool destroyed = false;
+    static thread_local struct Holder {
+      ThreadCache cache;
+      ~Holder() { destroyed = true; }
+    } holder;
+    if (destroyed) {
+      return nullptr;
+    }
+    if (!holder.cache.owner) {
+      holder.cache.owner = this;
+      lock_guard<mutex> lck(retired_mtx_);
+      caches_.push_back(&holder.cache);
+    }
+    return &holder.cache;
+  }
+
+  void Retire(ThreadCache *cache) {
+    for (int ii = 0; ii < kNumClasses; ++ii) {
+      if (cache->free[ii]) {
+        FreeBlock *tail = cache->free[ii];
+        while (tail->next) {
+          tail = tail->next;
+        }
+        PushDepot(ii, cache->free[ii], tail, cache->count[ii]);
+      }
+    }
+    lock_guard<mutex> lck(retired_mtx_);
+    Accumulate(*cache, &retired_);
+    caches_.erase(find(caches_.begin(), caches_.end(), cache));
+  }
+
+  FreeBlock *Pop(ThreadCache *cache, int cls) {
+    if (!cache->free[cls]) {
+      // Refill a batch from the depot.
+      lock_guard<mutex> lck(depot_[cls].mtx);
+      Depot& depot = depot_[cls];
+      while (depot.head && cache->count[cls] < kBatch) {
+        FreeBlock *block = depot.head;
+        depot.head = block->next;
+        --depot.count;
+        block->next = cache->free[cls];
+        cache->free[cls] = block;
+        ++cache->count[cls];
+      }
+      if (!cache->free[cls]) {
+        return nullptr;
+      }
+    }
+    FreeBlock *block = cache->free[cls];
+    cache->free[cls] = block->next;
+    --cache->count[cls];
+    return block;
+  }
+
+  void Spill(ThreadCache *cache, int cls) {
+    const int num = cache->count[cls] / 2;
+    FreeBlock *head = cache->free[cls];
+    FreeBlock *tail = head;
+    for (int ii = 1; ii < num; ++ii) {
+      tail = tail->next;
+    }
+    cache->free[cls] = tail->next;
+    cache->count[cls] -= num;
+    PushDepot(cls, head, tail, num);
+  }
+
+  FreeBlock *PopDepot(int cls) {
+    lock_guard<mutex> lck(depot_[cls].mtx);
+    FreeBlock *block = depot_[cls].head;
+    if (block) {
+      depot_[cls].head = block->next;
+      --depot_[cls].count;
+    }
+    return block;
+  }
+
+  void PushDepot(int cls, FreeBlock *head, FreeBlock *tail, int num) {
+    lock_guard<mutex> lck(depot_[cls].mtx);
+    tail->next = depot_[cls].head;
+    depot_[cls].head = head;
+    depot_[cls].count += num;
+  }
+
+  struct Depot {
+    mutex mtx;
+    FreeBlock *head = nullptr;
+    int64_t count = 0;
+  };
+  Depot depot_[kNumClasses];
+
+  mutable mutex retired_mtx_;
+  vector<ThreadCache *> caches_;
+  Stats retired_;
+};
+
+// Installed by main() when --sdk_allocator=pool.
+static PoolMemorySystem *g_pool_mem;
+
+// Request lifecycle stages that allocations are attributed to.
+enum AllocStage {
+  // Anything not covered below: SDK marshalling, response parsing, retries.
+  kAllocStageSdk,
+  // Request construction and submission in UploadThread/DownloadThread.
+  kAllocStageRequest,
+  // From HttpRequest creation until the request is signed.
+  kAllocStageSign,
+  // HttpClient::MakeRequest.
+  kAllocStageHttp,
+  // ObjUploadDone/ObjDownloadDone.
+  kAllocStageCallback,
+  kNumAllocStages
+};
+
+static const char *const kAllocStageNames[kNumAllocStages] = {
+  "sdk", "request", "build+sign", "http client", "callback"
+};
+
+static thread_local int t_alloc_stage = kAllocStageSdk;
+
+// Attributes the allocations of the calling thread to 'stage' for the
+// lifetime of the object.
+class AllocStageScope {
+ public:
+  explicit AllocStageScope(int stage) : prev_stage_(t_alloc_stage) {
+    t_alloc_stage = stage;
+  }
+
+  ~AllocStageScope() {
+    t_alloc_stage = prev_stage_;
+  }
+
+ private:
+  const int prev_stage_;
+};
+
+// Memory manager that counts allocations and bytes per AllocStage and
+// forwards to 'next', or to malloc like the SDK default when it is null.
+class CountingMemorySystem
+  : public Aws::Utils::Memory::MemorySystemInterface {
+ public:
+  struct Stats {
+    uint64_t allocs[kNumAllocStages] = {0};
+    uint64_t bytes[kNumAllocStages] = {0};
+  };
+
+  explicit CountingMemorySystem(MemorySystemInterface *next) : next_(next) {}
+
+  void Begin() override {
+    if (next_) {
+      next_->Begin();
+    }
+  }
+
+  void End() override {
+    if (next_) {
+      next_->End();
+    }
+  }
+
+  void* AllocateMemory(size_t size,
+                       size_t alignment,
+                       const char *allocation_tag) override {
+    Counter& counter = counters_[t_alloc_stage];
+    counter.allocs.fetch_add(1, memory_order_relaxed);
+    counter.bytes.fetch_add(size, memory_order_relaxed);
+    return next_ ? next_->AllocateMemory(size, alignment, allocation_tag) :
+                   malloc(size);
+  }
+
+  void FreeMemory(void *ptr) override {
+    if (next_) {
+      next_->FreeMemory(ptr);
+    } else {
+      free(ptr);
+    }
+  }
+
+  Stats GetStats() const {
+    Stats stats;
+    for (int ii = 0; ii < kNumAllocStages; ++ii) {
+      stats.allocs[ii] = counters_[ii].allocs.load(memory_order_relaxed);
+      stats.bytes[ii] = counters_[ii].bytes.load(memory_order_relaxed);
+    }
+    return stats;
+  }
+
+ private:
+  struct Counter {
+    atomic<uint64_t> allocs{0};
+    atomic<uint64_t> bytes{0};
+    // Keep the counters of different stages on separate cache lines.
+    char pad[64 - 2 * sizeof(atomic<uint64_t>)];
+  };
+
+  MemorySystemInterface *const next_;
+  Counter counters_[kNumAllocStages];
+};
+
+// Installed by main() when --alloc_profile is set.
+static CountingMemorySystem *g_alloc_counter;
+
+static void PrintAllocStats() {
+  if (!g_pool_mem) {
+    return;
+  }
+  const PoolMemorySystem::Stats stats = g_pool_mem->GetStats();
+  cout << "SDK allocations by size class:" << endl;
+  for (int ii = 0; ii <= PoolMemorySystem::kNumClasses; ++ii) {
+    if (ii == PoolMemorySystem::kLargeClass) {
+      cout << "  large: ";
+    } else {
+      cout << "  <= " << PoolMemorySystem::ClassSize(ii) << " B: ";
+    }
+    cout << stats.allocs[ii] << " allocations, " << stats.bytes[ii]
+         << " bytes" << endl;
+  }
+  const uint64_t total = stats.TotalAllocs();
+  cout << "  pool hit rate: "
+       << (total ? 100.0 * stats.pool_hits / total : 0) << "%" << endl
+       << endl;
+}
+
+//-----------------------------------------------------------------------------
+
+// Lock-free latency histogram in microseconds with 16 linear buckets per
+// power of two, which bounds the error of the percentiles to 1/16.
+class LatencyHistogram {
+ public:
+  static constexpr int kNumBuckets = 38 * 16;
+
+  struct Snapshot {
+    vector<int64_t> counts = vector<int64_t>(kNumBuckets);
+
+    int64_t Count() const {
+      int64_t count = 0;
+      for (int64_t c : counts) {
+        count += c;
+      }
+      return count;
+    }
+
+    // Returns the upper bound of the bucket holding the given percentile.
+    int64_t Percentile(double pct) const {
+      const int64_t count = Count();
+      int64_t seen = 0;
+      for (int ii = 0; ii < kNumBuckets; ++ii) {
+        seen += counts[ii];
+        if (count > 0 && seen >= pct / 100 * count) {
+          return BucketValue(ii + 1) - 1;
+        }
+      }
+      return 0;
+    }
+
+    Snapshot operator-(const Snapshot& other) const {
+      Snapshot diff;
+      for (int ii = 0; ii < kNumBuckets; ++ii) {
+        diff.counts[ii] = counts[ii] - other.counts[ii];
+      }
+      return diff;
+    }
+
+    // "p50 1.2, p90 3.4, p99 5.6, p99.9 7.8, max 9.1 ms".
+    string Format() const {
+      ostringstream out;
+      out << "p50 " << Percentile(50) / 1000.0 << ", p90 "
+          << Percentile(90) / 1000.0 << ", p99 " << Percentile(99) / 1000.0
+          << ", p99.9 " << Percentile(99.9) / 1000.0 << ", max "
+          << Percentile(100) / 1000.0 << " ms";
+      return out.str();
+    }
+  };
+
+  LatencyHistogram() {
+    for (int ii = 0; ii < kNumBuckets; ++ii) {
+      counts_[ii] = 0;
+    }
+  }
+
+  void Add(int64_t us) {
+    counts_[Bucket(max<int64_t>(us, 0))].fetch_add(1, memory_order_relaxed);
+  }
+
+  Snapshot GetSnapshot() const {
+    Snapshot snapshot;
+    for (int ii = 0; ii < kNumBuckets; ++ii) {
+      snapshot.counts[ii] = counts_[ii].load(memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+ private:
+  static int Bucket(int64_t us) {
+    if (us < 16) {
+      return us;
+    }
+    const int exp = 63 - __builtin_clzll(us);
+    return min((exp - 3) * 16 + (int)((us >> (exp - 4)) & 15),
+               kNumBuckets - 1);
+  }
+
+  // Lower bound of the bucket.
+  static int64_t BucketValue(int bucket) {
+    if (bucket < 16) {
+      return bucket;
+    }
+    const int exp = bucket / 16 + 3;
+    return (16 + (int64_t)(bucket % 16)) << (exp - 4);
+  }
+
+  atomic<int64_t> counts_[kNumBuckets];
+};
+
+// Submit to completion latency of all requests.
+static LatencyHistogram g_latency;
+
+// Connection setup of the HTTP request being made by the thread, filled in
+// by the HTTP clients.
+struct ConnTrace {
+  bool new_conn = false;
+  steady_clock::time_point connect_start;
+  // The connection is set up and the request about to be sent.
+  steady_clock::time_point ready;
+};
+static thread_local ConnTrace t_conn_trace;
+
+// HTTP request the thread is making, and whether its last attempt ended
+// cancelled. The retry strategy runs on the same thread right after.
+static thread_local const Aws::Http::HttpRequest *t_http_request = nullptr;
+static thread_local bool t_request_cancelled = false;
+
+// HTTP requests on new and on reused connections.
+static atomic<int64_t> g_new_conns{0};
+static atomic<int64_t> g_reused_conns{0};
+// Set while --prewarm opens the connections. Its requests are left out of
+// the connection, partition and streaming stats, and its time out of the
+// stage durations.
+static atomic<bool> g_prewarming{false};
+static atomic<int64_t> g_prewarm_conns{0};
+static atomic<int64_t> g_prewarm_ns{0};
+// Connect and TLS handshake time of new connections, and time of requests
+// from the moment their connection is ready.
+static LatencyHistogram g_handshake_latency;
+static LatencyHistogram g_transfer_latency;
+
+// Body of the HTTP response being received by the thread, filled in by the
+// data received handler of the GETs.
+struct StreamTrace {
+  int64_t bytes = 0;
+  steady_clock::time_point first_byte;
+  steady_clock::time_point last_byte;
+};
+static thread_local StreamTrace t_stream_trace;
+
+// Time to first byte of the GET bodies from the moment the request is sent
+// on a ready connection, time from the first to the last byte, and streaming
+// rate of the bodies in KB/sec.
+static LatencyHistogram g_ttfb_latency;
+static LatencyHistogram g_body_latency;
+static LatencyHistogram g_stream_rate;
+
+static void OnBodyReceived(int64_t bytes) {
+  AddMovedBytes(bytes);
+  StreamTrace& trace = t_stream_trace;
+  trace.last_byte = steady_clock::now();
+  if (trace.bytes == 0) {
+    trace.first_byte = trace.last_byte;
+  }
+  trace.bytes += bytes;
+}
+
+static void RecordStream(int64_t ttfb_us, int64_t body_us, int64_t bytes) {
+  g_ttfb_latency.Add(ttfb_us);
+  g_body_latency.Add(body_us);
+  // A body that arrived in a single read has no measurable rate.
+  if (body_us > 0) {
+    g_stream_rate.Add(bytes * 1000000 / 1024 / body_us);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Rate limiting
+//-----------------------------------------------------------------------------
+
+// Lock-free token bucket in the GCRA form. A single atomic holds the time at
+// which the bucket would be full again; a caller reserves its tokens with
+// one CAS and then waits until that time minus the burst has passed.
+class TokenBucket {
+ public:
+  TokenBucket(double tokens_per_sec, double burst_sec)
+  : ns_per_token_(1e9 / tokens_per_sec), burst_ns_(burst_sec * 1e9) {}
+
+  // Takes the tokens and returns how long the caller has to wait for them.
+  nanoseconds Reserve(double tokens) {
+    const int64_t cost = tokens * ns_per_token_;
+    const int64_t now = NowNs();
+    int64_t full = full_ns_.load(memory_order_relaxed);
+    int64_t new_full;
+    do {
+      new_full = max(full, now) + cost;
+    } while (!full_ns_.compare_exchange_weak(full, new_full,
+                                             memory_order_relaxed));
+    return nanoseconds(max<int64_t>(new_full - burst_ns_ - now, 0));
+  }
+
+  // Returns the tokens of a request that did not go through.
+  void Refund(double tokens) {
+    full_ns_.fetch_sub(tokens * ns_per_token_, memory_order_relaxed);
+  }
+
+ private:
+  static int64_t NowNs() {
+    return duration_cast<nanoseconds>(
+      steady_clock::now().time_since_epoch()).count();
+  }
+
+  const double ns_per_token_;
+  const int64_t burst_ns_;
+  atomic<int64_t> full_ns_{0};
+};
+
+// Ops/s and bytes/s limits shared by all the submitting threads.
+class RateLimiter {
+ public:
+  struct Stats {
+    int64_t throttled_req = 0;
+    int64_t throttled_ns = 0;
+  };
+
+  RateLimiter() {
+    const double burst_sec = FLAGS_rate_limit_burst_ms / 1000;
+    if (FLAGS_rate_limit_ops > 0) {
+      ops_.reset(new TokenBucket(FLAGS_rate_limit_ops, burst_sec));
+    }
+    if (FLAGS_rate_limit_mbps > 0) {
+      bytes_.reset(new TokenBucket(FLAGS_rate_limit_mbps * (1 << 20),
+                                   burst_sec));
+    }
+  }
+
+  // Charges a request of the given size and returns how long its
+  // submission must wait.
+  nanoseconds Reserve(int64_t bytes) {
+    nanoseconds wait(0);
+    if (ops_) {
+      wait = ops_->Reserve(1);
+    }
+    if (bytes_) {
+      wait = max(wait, bytes_->Reserve(bytes));
+    }
+    if (wait.count() > 0) {
+      throttled_req_.fetch_add(1, memory_order_relaxed);
+      throttled_ns_.fetch_add(wait.count(), memory_order_relaxed);
+    }
+    return wait;
+  }
+
+  // Blocks until a request of the given size may be submitted.
+  void Acquire(int64_t bytes) {
+    const nanoseconds wait = Reserve(bytes);
+    if (wait.count() > 0) {
+      this_thread::sleep_for(wait);
+    }
+  }
+
+  void Refund(int64_t bytes) {
+    if (ops_) {
+      ops_->Refund(1);
+    }
+    if (bytes_) {
+      bytes_->Refund(bytes);
+    }
+  }
+
+  Stats GetStats() const {
+    Stats stats;
+    stats.throttled_req = throttled_req_.load(memory_order_relaxed);
+    stats.throttled_ns = throttled_ns_.load(memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  unique_ptr<TokenBucket> ops_;
+  unique_ptr<TokenBucket> bytes_;
+  atomic<int64_t> throttled_req_{0};
+  atomic<int64_t> throttled_ns_{0};
+};
+
+// Set up by main() when any rate limit is on.
+static unique_ptr<RateLimiter> g_rate_limiter;
+
+// Charges a request against the rate limits right before its submission.
+static void Throttle(int64_t bytes) {
+  if (g_rate_limiter) {
+    g_rate_limiter->Acquire(bytes);
+  }
+}
+
+// Charges a request without blocking and returns when it may be submitted.
+// Used by the drivers that run all their transfers on one thread, which
+// keep the others going until then.
+static steady_clock::time_point ReserveThrottle(int64_t bytes) {
+  const steady_clock::time_point now = steady_clock::now();
+  return g_rate_limiter ? now + g_rate_limiter->Reserve(bytes) : now;
+}
+
+// Poll timeout in ms until 'when', rounded up, at most 'max_ms'.
+static int PollTimeoutMs(steady_clock::time_point when, int max_ms) {
+  const int64_t ns = duration_cast<nanoseconds>(
+    when - steady_clock::now()).count();
+  return (int)max<int64_t>(min<int64_t>((ns + 999999) / 1000000, max_ms), 0);
+}
+
+// Gives back the charge of a request that was cancelled, or not submitted
+// after all.
+static void RefundThrottle(int64_t bytes) {
+  if (g_rate_limiter) {
+    g_rate_limiter->Refund(bytes);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Socket tuning
+//-----------------------------------------------------------------------------
+
+// Options of a socket as read back with getsockopt().
+struct SockOpts {
+  int sndbuf = 0;
+  int rcvbuf = 0;
+  int nodelay = 0;
+  string congestion;
+  int keepalive = 0;
+  int keepidle = 0;
+  int keepintvl = 0;
+
+  string Format() const {
+    ostringstream out;
+    out << "SO_SNDBUF " << sndbuf << ", SO_RCVBUF " << rcvbuf
+        << ", TCP_NODELAY " << nodelay << ", TCP_CONGESTION " << congestion
+        << ", SO_KEEPALIVE " << keepalive;
+    if (keepalive) {
+      out << " (idle " << keepidle << " s, interval " << keepintvl << " s)";
+    }
+    return out.str();
+  }
+};
+
+// Effective options of the last tuned connection.
+static mutex g_sock_opts_mtx;
+static SockOpts g_sock_opts;
+static atomic<int64_t> g_tuned_sockets{0};
+
+static SockOpts GetSockOpts(int fd) {
+  SockOpts opts;
+  socklen_t len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opts.sndbuf, &len);
+  len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts.rcvbuf, &len);
+  len = sizeof(int);
+  getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opts.nodelay, &len);
+  char congestion[16] = {};
+  len = sizeof(congestion) - 1;
+  getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion, &len);
+  opts.congestion = congestion;
+  len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opts.keepalive, &len);
+  len = sizeof(int);
+  getsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opts.keepidle, &len);
+  len = sizeof(int);
+  getsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opts.keepintvl, &len);
+  return opts;
+}
+
+// Applies the socket flags to a new connection before it connects and
+// records the resulting options. Returns 0, or the errno of the option that
+// failed with its name in *failed.
+static int TuneSocket(int fd, const char **failed = nullptr) {
+  struct Opt {
+    bool apply;
+    int level, name, value;
+    const char *what;
+  };
+  const Opt opts[] = {
+    { FLAGS_so_sndbuf > 0, SOL_SOCKET, SO_SNDBUF, FLAGS_so_sndbuf,
+      "SO_SNDBUF" },
+    { FLAGS_so_rcvbuf > 0, SOL_SOCKET, SO_RCVBUF, FLAGS_so_rcvbuf,
+      "SO_RCVBUF" },
+    { FLAGS_tcp_nodelay >= 0, IPPROTO_TCP, TCP_NODELAY, FLAGS_tcp_nodelay,
+      "TCP_NODELAY" },
+    { FLAGS_tcp_keepalive_sec > 0, SOL_SOCKET, SO_KEEPALIVE, 1,
+      "SO_KEEPALIVE" },
+    { FLAGS_tcp_keepalive_sec > 0, IPPROTO_TCP, TCP_KEEPIDLE,
+      FLAGS_tcp_keepalive_sec, "TCP_KEEPIDLE" },
+    { FLAGS_tcp_keepalive_sec > 0, IPPROTO_TCP, TCP_KEEPINTVL,
+      FLAGS_tcp_keepalive_sec, "TCP_KEEPINTVL" },
+  };
+  for (const Opt& opt : opts) {
+    if (opt.apply &&
+        setsockopt(fd, opt.level, opt.name, &opt.value, sizeof(int)) < 0) {
+      if (failed) {
+        *failed = opt.what;
+      }
+      return errno;
+    }
+  }
+  if (!FLAGS_tcp_congestion.empty() &&
+      setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+                 FLAGS_tcp_congestion.c_str(),
+                 FLAGS_tcp_congestion.size()) < 0) {
+    if (failed) {
+      *failed = "TCP_CONGESTION";
+    }
+    return errno;
+  }
+
+  const SockOpts effective = GetSockOpts(fd);
+  lock_guard<mutex> lck(g_sock_opts_mtx);
+  g_sock_opts = effective;
+  ++g_tuned_sockets;
+  return 0;
+}
+
+// CURLOPT_SOCKOPTFUNCTION of the curl based clients.
+static int CurlTuneSocket(void *, curl_socket_t fd, curlsocktype) {
+  return TuneSocket(fd) ? CURL_SOCKOPT_ERROR : CURL_SOCKOPT_OK;
+}
+
+// Source addresses parsed from --local_addrs.
+static vector<string> g_local_addrs;
+
+// Source address of client N, or empty to let the kernel pick.
+static string LocalAddr(int client_num) {
+  return g_local_addrs.empty() ? "" :
+    g_local_addrs[client_num % g_local_addrs.size()];
+}
+
+// Source address of the HTTP client the thread creates next. The SDK builds
+// the HTTP client inside the S3Client constructor with no room for it in the
+// ClientConfiguration.
+static thread_local string t_client_local_addr;
+
+// Binds a socket to a source address before it connects. Returns 0 or an
+// errno.
+static int BindLocalAddr(int fd, int family, const string& addr) {
+  if (addr.empty()) {
+    return 0;
+  }
+  sockaddr_storage ss = {};
+  socklen_t len;
+  if (family == AF_INET) {
+    sockaddr_in *sin = reinterpret_cast<sockaddr_in *>(&ss);
+    sin->sin_family = AF_INET;
+    len = sizeof(*sin);
+    if (inet_pton(AF_INET, addr.c_str(), &sin->sin_addr) != 1) {
+      return EAFNOSUPPORT;
+    }
+  } else {
+    sockaddr_in6 *sin6 = reinterpret_cast<sockaddr_in6 *>(&ss);
+    sin6->sin6_family = AF_INET6;
+    len = sizeof(*sin6);
+    if (inet_pton(AF_INET6, addr.c_str(), &sin6->sin6_addr) != 1) {
+      return EAFNOSUPPORT;
+    }
+  }
+  return bind(fd, reinterpret_cast<sockaddr *>(&ss), len) < 0 ? errno : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Endpoints
+//-----------------------------------------------------------------------------
+
+// Endpoints parsed from --endpoint. A single empty one stands for the AWS
+// endpoint.
+static vector<string> g_endpoints;
+
+struct EndpointStats {
+  atomic<int> outstanding{0};
+  atomic<int64_t> done_obj{0};
+  LatencyHistogram latency;
+};
+static vector<unique_ptr<EndpointStats>> g_endpoint_stats;
+
+// Consistent hash ring of --lb_policy=key_hash with virtual nodes, sorted by
+// hash.
+static vector<pair<uint64_t, int>> g_endpoint_ring;
+
+static void InitEndpoints() {
+  istringstream in(FLAGS_endpoint);
+  string endpoint;
+  while (getline(in, endpoint, ',')) {
+    g_endpoints.push_back(endpoint);
+  }
+  if (g_endpoints.empty()) {
+    g_endpoints.push_back("");
+  }
+  for (size_t ii = 0; ii < g_endpoints.size(); ++ii) {
+    g_endpoint_stats.emplace_back(new EndpointStats());
+    for (int vnode = 0; vnode < 100; ++vnode) {
+      const string name = g_endpoints[ii] + "#" + to_string(vnode);
+      g_endpoint_ring.emplace_back(HashKey(name.data(), name.size()), ii);
+    }
+  }
+  sort(g_endpoint_ring.begin(), g_endpoint_ring.end());
+}
+
+// Returns the endpoint to send the request for the given key to.
+static int PickEndpoint(const Aws::String& key) {
+  static atomic<uint64_t> next{0};
+  const int num_endpoints = g_endpoints.size();
+  if (num_endpoints == 1) {
+    return 0;
+  }
+  if (FLAGS_lb_policy == "key_hash") {
+    const uint64_t hash = HashKey(key.data(), key.size());
+    auto it = lower_bound(g_endpoint_ring.begin(), g_endpoint_ring.end(),
+                          make_pair(hash, 0));
+    return it == g_endpoint_ring.end() ? g_endpoint_ring[0].second :
+                                         it->second;
+  }
+  const int first = next++ % num_endpoints;
+  if (FLAGS_lb_policy == "round_robin") {
+    return first;
+  }
+  // Least outstanding, breaking ties round-robin.
+  int best = first;
+  for (int ii = 1; ii < num_endpoints; ++ii) {
+    const int endpoint = (first + ii) % num_endpoints;
+    if (g_endpoint_stats[endpoint]->outstanding <
+        g_endpoint_stats[best]->outstanding) {
+      best = endpoint;
+    }
+  }
+  return best;
+}
+
+static void BeginEndpointRequest(int endpoint) {
+  ++g_endpoint_stats[endpoint]->outstanding;
+}
+
+static void EndEndpointRequest(int endpoint, int64_t latency_us) {
+  EndpointStats *stats = g_endpoint_stats[endpoint].get();
+  --stats->outstanding;
+  ++stats->done_obj;
+  stats->latency.Add(latency_us);
+}
+
+//-----------------------------------------------------------------------------
+
+class ReportDuration {
+ public:
+  ReportDuration(const string& operation,
+                 int num_threads,
+                 int obj_per_thread,
+                 int obj_size_kb)
+  : operation_(operation), num_threads_(num_threads),
+    obj_per_thread_(obj_per_thread), obj_size_kb_(obj_size_kb) {
+
+    cout << operation << " starting" << endl;
+    if (g_pool_mem) {
+      alloc_stats0_ = g_pool_mem->GetStats();
+    }
+    if (g_alloc_counter) {
+      stage_stats0_ = g_alloc_counter->GetStats();
+    }
+    if (g_rate_limiter) {
+      rate_stats0_ = g_rate_limiter->GetStats();
+    }
+    proc0_ = GetProcUsage();
+    latency0_ = g_latency.GetSnapshot();
+    for (const auto& stats : g_partition_stats) {
+      partition_req0_.push_back(stats->requests);
+      partition_throttled0_.push_back(stats->throttled);
+    }
+    for (const auto& stats : g_endpoint_stats) {
+      endpoint_obj0_.push_back(stats->done_obj);
+      endpoint_latency0_.push_back(stats->latency.GetSnapshot());
+    }
+    new_conns0_ = g_new_conns;
+    reused_conns0_ = g_reused_conns;
+    handshake0_ = g_handshake_latency.GetSnapshot();
+    transfer0_ = g_transfer_latency.GetSnapshot();
+    ttfb0_ = g_ttfb_latency.GetSnapshot();
+    body0_ = g_body_latency.GetSnapshot();
+    stream_rate0_ = g_stream_rate.GetSnapshot();
+    done_obj0_ = g_done_obj;
+    done_bytes0_ = g_done_bytes;
+    prewarm_ns0_ = g_prewarm_ns;
+    recv_fallbacks0_ = RecvBufferFallbacks();
+    t0_ = high_resolution_clock::now();
+  }
+
+  ~ReportDuration() {
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    // Without the pre-warm of the iterations of a stage.
+    const double time_sec =
+      duration_cast<duration<double>>(t1 - t0_).count() -
+      (g_prewarm_ns - prewarm_ns0_) / 1e9;
+    // A stage stopped by a signal reports the objects it completed.
+    const bool interrupted = Stopping();
+    const int64_t total_obj = interrupted ?
+      g_done_obj - done_obj0_ : (int64_t)num_threads_ * obj_per_thread_;
+    const double total_size_mb = interrupted ?
+      (g_done_bytes - done_bytes0_) / 1048576.0 :
+      (double)obj_size_kb_ * total_obj / 1024;
+    // Divisor of the per-object figures.
+    const int64_t num_obj = max<int64_t>(total_obj, 1);
+    cout << operation_
+         << (interrupted ? " interrupted after " : " completed in ")
+         << time_sec << " seconds (total: " << total_obj << " objects, "
+         << total_size_mb << " MB)" << endl
+         << operation_ << " throughput: " << (total_size_mb / time_sec)
+         << " MB/sec, " << (total_obj / time_sec) << " obj/sec" << endl
+         << operation_ << " latency: "
+         << (g_latency.GetSnapshot() - latency0_).Format() << endl;
+    const ProcUsage proc = GetProcUsage();
+    const double user_sec = proc.user_sec - proc0_.user_sec;
+    const double sys_sec = proc.sys_sec - proc0_.sys_sec;
+    cout << operation_ << " CPU: " << (1000 * (user_sec + sys_sec) / num_obj)
+         << " ms/obj (user " << user_sec << " s, sys " << sys_sec
+         << " s), page faults: minor "
+         << (proc.minor_faults - proc0_.minor_faults) << ", major "
+         << (proc.major_faults - proc0_.major_faults) << endl;
+    const int64_t voluntary_csw = proc.voluntary_csw - proc0_.voluntary_csw;
+    const int64_t involuntary_csw =
+      proc.involuntary_csw - proc0_.involuntary_csw;
+    cout << operation_ << " context switches: "
+         << ((double)(voluntary_csw + involuntary_csw) / num_obj)
+         << " per object (voluntary " << voluntary_csw << ", involuntary "
+         << involuntary_csw << ")" << endl;
+    if (!g_recv_pools.empty()) {
+      cout << operation_ << " receive buffer fallbacks: "
+           << (RecvBufferFallbacks() - recv_fallbacks0_)
+           << " responses read into unprefaulted streams" << endl;
+    }
+    PrintPartitions(time_sec);
+    if (g_endpoints.size() > 1) {
+      for (size_t ii = 0; ii < g_endpoints.size(); ++ii) {
+        const EndpointStats& stats = *g_endpoint_stats[ii];
+        const int64_t obj = stats.done_obj - endpoint_obj0_[ii];
+        cout << operation_ << " endpoint " << g_endpoints[ii] << ": " << obj
+             << " objects, "
+             << ((double)obj_size_kb_ * obj / 1024 / time_sec)
+             << " MB/sec, latency "
+             << (stats.latency.GetSnapshot() - endpoint_latency0_[ii]).Format()
+             << endl;
+      }
+    }
+    const int64_t new_conns = g_new_conns - new_conns0_;
+    const int64_t reused_conns = g_reused_conns - reused_conns0_;
+    if (new_conns + reused_conns > 0) {
+      cout << operation_ << " connections: " << new_conns << " new, "
+           << reused_conns << " reused ("
+           << (100.0 * reused_conns / (new_conns + reused_conns))
+           << "% of requests)" << endl;
+      if (new_conns > 0) {
+        cout << operation_ << " handshake: "
+             << (g_handshake_latency.GetSnapshot() - handshake0_).Format()
+             << endl;
+      }
+      cout << operation_ << " transfer: "
+           << (g_transfer_latency.GetSnapshot() - transfer0_).Format()
+           << endl;
+    }
+    const LatencyHistogram::Snapshot ttfb =
+      g_ttfb_latency.GetSnapshot() - ttfb0_;
+    if (ttfb.Count() > 0) {
+      const LatencyHistogram::Snapshot stream_rate =
+        g_stream_rate.GetSnapshot() - stream_rate0_;
+      cout << operation_ << " TTFB: " << ttfb.Format() << endl
+           << operation_ << " body transfer: "
+           << (g_body_latency.GetSnapshot() - body0_).Format() << endl
+           << operation_ << " streaming rate per connection: p1 "
+           << stream_rate.Percentile(1) / 1024.0 << ", p10 "
+           << stream_rate.Percentile(10) / 1024.0 << ", p50 "
+           << stream_rate.Percentile(50) / 1024.0 << ", p90 "
+           << stream_rate.Percentile(90) / 1024.0 << " MB/sec" << endl;
+    }
+    if (g_tuned_sockets > 0) {
+      lock_guard<mutex> lck(g_sock_opts_mtx);
+      cout << operation_ << " socket options: " << g_sock_opts.Format()
+           << endl;
+    }
+    if (g_rate_limiter) {
+      const RateLimiter::Stats stats = g_rate_limiter->GetStats();
+      const double throttled_sec =
+        (stats.throttled_ns - rate_stats0_.throttled_ns) / 1e9;
+      cout << operation_ << " throttled: "
+           << (stats.throttled_req - rate_stats0_.throttled_req)
+           << " requests, " << throttled_sec << " s total, "
+           << (1000 * throttled_sec / num_obj) << " ms/obj" << endl;
+    }
+    if (g_pool_mem) {
+      const PoolMemorySystem::Stats stats = g_pool_mem->GetStats();
+      const uint64_t allocs =
+        stats.TotalAllocs() - alloc_stats0_.TotalAllocs();
+      const uint64_t bytes = stats.TotalBytes() - alloc_stats0_.TotalBytes();
+      cout << operation_ << " SDK allocations: "
+           << ((double)allocs / num_obj) << " per object, "
+           << ((double)bytes / num_obj) << " bytes per object" << endl;
+    }
+    if (g_alloc_counter) {
+      const CountingMemorySystem::Stats stats = g_alloc_counter->GetStats();
+      cout << operation_ << " SDK allocations per object by stage:" << endl;
+      for (int ii = 0; ii < kNumAllocStages; ++ii) {
+        cout << operation_ << "   " << kAllocStageNames[ii] << ": "
+             << ((double)(stats.allocs[ii] - stage_stats0_.allocs[ii]) /
+                 num_obj) << " allocs/op, "
+             << ((double)(stats.bytes[ii] - stage_stats0_.bytes[ii]) /
+                 num_obj) << " bytes/op" << endl;
+      }
+    }
+    cout << endl;
+    fflush(stdout);
+  }
+
+ private:
+  // Prints the request rate and throttling of every partition, or a summary
+  // if there are many.
+  void PrintPartitions(double time_sec) const {
+    const size_t num_partitions = g_partition_stats.size();
+    int64_t total_req = 0, total_throttled = 0;
+    double min_rate = 0, max_rate = 0;
+    for (size_t ii = 0; ii < num_partitions; ++ii) {
+      const int64_t req = g_partition_stats[ii]->requests - partition_req0_[ii];
+      const int64_t throttled =
+        g_partition_stats[ii]->throttled - partition_throttled0_[ii];
+      total_req += req;
+      total_throttled += throttled;
+      min_rate = ii == 0 ? req / time_sec : min(min_rate, req / time_sec);
+      max_rate = max(max_rate, req / time_sec);
+      if (num_partitions > 1 && num_partitions <= 16) {
+        cout << operation_ << " prefix " << PartitionBucket(ii) << "/"
+             << g_key_prefixes[ii % g_key_prefixes.size()] << ": "
+             << (req / time_sec) << " req/sec, " << throttled
+             << " throttled" << endl;
+      }
+    }
+    if (total_req == 0) {
+      return;
+    }
+    cout << operation_ << " prefixes: " << num_partitions << ", "
+         << min_rate << " - " << max_rate << " req/sec per prefix, "
+         << total_throttled << " throttled ("
+         << (100.0 * total_throttled / total_req) << "% of requests)"
+         << endl;
+  }
+
+  const string operation_;
+  const int num_threads_, obj_per_thread_, obj_size_kb_;
+  high_resolution_clock::time_point t0_;
+  PoolMemorySystem::Stats alloc_stats0_;
+  CountingMemorySystem::Stats stage_stats0_;
+  RateLimiter::Stats rate_stats0_;
+  ProcUsage proc0_;
+  LatencyHistogram::Snapshot latency0_;
+  vector<int64_t> partition_req0_, partition_throttled0_;
+  vector<int64_t> endpoint_obj0_;
+  vector<LatencyHistogram::Snapshot> endpoint_latency0_;
+  int64_t new_conns0_, reused_conns0_;
+  int64_t done_obj0_, done_bytes0_, prewarm_ns0_, recv_fallbacks0_;
+  LatencyHistogram::Snapshot handshake0_, transfer0_;
+  LatencyHistogram::Snapshot ttfb0_, body0_, stream_rate0_;
+};
+
+static int64_t ElapsedUs(steady_clock::time_point t0) {
+  return duration_cast<microseconds>(steady_clock::now() - t0).count();
+}
+
+// Process-wide in-flight limit of --admission=global. Submitters are
+// admitted in arrival order, so a thread that keeps submitting cannot starve
+// the others.
+class AdmissionController {
+ public:
+  explicit AdmissionController(int limit) : limit_(limit) {}
+
+  void Acquire() {
+    unique_lock<mutex> lck(mtx_);
+    const uint64_t ticket = next_ticket_++;
+    cond_.wait(lck, [this, ticket] {
+      return ticket == serving_ && in_flight_ < limit_;
+    });
+    ++serving_;
+    ++in_flight_;
+    // The next ticket may fit as well.
+    cond_.notify_all();
+  }
+
+  void Release() {
+    unique_lock<mutex> lck(mtx_);
+    assert(in_flight_ > 0);
+    --in_flight_;
+    cond_.notify_all();
+  }
+
+ private:
+  const int limit_;
+  mutex mtx_;
+  condition_variable cond_;
+  uint64_t next_ticket_ = 0;
+  uint64_t serving_ = 0;
+  int in_flight_ = 0;
+};
+
+static unique_ptr<AdmissionController> g_admission;
+
+// Average in-flight requests of each thread over its last run.
+static vector<double> g_thread_in_flight;
+
+// In-flight slots of one submitting thread. With --admission=global the
+// slots come from g_admission instead of a fixed per-thread budget.
+class Ctx {
+ public:
+  explicit Ctx(int thread_num)
+  : thread_num_(thread_num), start_(steady_clock::now()),
+    last_change_(start_) {}
+
+  void GetAvailableSlot() {
+    if (g_admission) {
+      g_admission->Acquire();
+      unique_lock<mutex> lck(mtx_);
+      UpdateBusy();
+      ++num_outstanding_req_;
+      return;
+    }
+    unique_lock<mutex> lck(mtx_);
+    // Wait for a free slot.
+    cond_.wait(lck, [this] {
+      return num_outstanding_req_ < FLAGS_num_outstanding_req;
+    });
+    assert(num_outstanding_req_ < FLAGS_num_outstanding_req);
+    UpdateBusy();
+    ++num_outstanding_req_;
+  }
+
+  void ReleaseSlot() const {
+    {
+      unique_lock<mutex> lck(mtx_);
+      assert(num_outstanding_req_ > 0);
+      UpdateBusy();
+      --num_outstanding_req_;
+      cond_.notify_one();
+    }
+    if (g_admission) {
+      g_admission->Release();
+    }
+  }
+
+  void WaitAll() {
+    // Wait for all outstanding requests to complete.
+    unique_lock<mutex> lck(mtx_);
+    while (num_outstanding_req_ > 0) {
+      cond_.wait(lck);
+    }
+    const double elapsed_us = ElapsedUs(start_);
+    if (elapsed_us > 0) {
+      g_thread_in_flight[thread_num_] = busy_slot_us_ / elapsed_us;
+    }
+  }
+
+ private:
+  // Integrates the in-flight count over time.
+  void UpdateBusy() const {
+    const steady_clock::time_point now = steady_clock::now();
+    busy_slot_us_ += (double)num_outstanding_req_ *
+      duration_cast<microseconds>(now - last_change_).count();
+    last_change_ = now;
+  }
+
+  const int thread_num_;
+  const steady_clock::time_point start_;
+  mutable mutex mtx_;
+  mutable condition_variable cond_;
+  mutable int num_outstanding_req_{0};
+  mutable steady_clock::time_point last_change_;
+  mutable double busy_slot_us_ = 0;
+};
+
+// Waits for a slot of 'ctx' and for the rate limits before a submission.
+// Returns false, giving both back, if the program started stopping
+// meanwhile.
+static bool AcquireSubmission(Ctx *ctx) {
+  ctx->GetAvailableSlot();
+  Throttle(ObjSize());
+  if (Stopping()) {
+    RefundThrottle(ObjSize());
+    ctx->ReleaseSlot();
+    return false;
+  }
+  return true;
+}
+
+// Whether the threads of the client stack submit through Ctx.
+static bool UsesCtx() {
+  return (FLAGS_client == "s3" && FLAGS_api == "async") ||
+    FLAGS_client == "crt" || FLAGS_client == "transfer";
+}
+
+// Prints the average in-flight requests of every thread as a share of its
+// slots, or of its fair share of the global limit.
+static void PrintSlotUtilization(const string& operation) {
+  const double slots = g_admission ?
+    (double)FLAGS_max_in_flight / FLAGS_num_threads : FLAGS_num_outstanding_req;
+  cout << operation << " slot utilization per thread:";
+  for (double in_flight : g_thread_in_flight) {
+    cout << " " << (int)(100 * in_flight / slots + 0.5) << "%";
+  }
+  cout << endl;
+}
+
+// A request of the SDK clients from its submission until the SDK releases
+// it, listed in g_in_flight while it exists.
+struct InFlightReq {
+  string key;
+  const char *op;
+  steady_clock::time_point submit_time;
+  // HTTP attempts, counted by the request signed handler.
+  atomic<int> attempts{0};
+  // Set by the stall watchdog, makes the HTTP client abort the transfer.
+  atomic<bool> cancelled{false};
+};
+
+// Table of the in-flight requests, sharded by request id.
+class InFlightTable {
+ public:
+  struct Entry {
+    string key;
+    const char *op;
+    steady_clock::time_point submit_time;
+    int attempts;
+  };
+
+  // Registers a new request, which leaves the table when its last reference
+  // is released.
+  shared_ptr<InFlightReq> Add(const Aws::String& key, const char *op) {
+    const int64_t id = next_id_++;
+    InFlightReq *req = new InFlightReq();
+    req->key.assign(key.c_str(), key.size());
+    req->op = op;
+    req->submit_time = steady_clock::now();
+    Shard& shard = shards_[id % kNumShards];
+    {
+      lock_guard<mutex> lck(shard.mtx);
+      shard.reqs.emplace(id, req);
+    }
+    return shared_ptr<InFlightReq>(req, [&shard, id](InFlightReq *req) {
+      {
+        lock_guard<mutex> lck(shard.mtx);
+        shard.reqs.erase(id);
+      }
+      delete req;
+    });
+  }
+
+  // Returns the requests, oldest first.
+  vector<Entry> GetEntries() {
+    vector<Entry> entries;
+    for (Shard& shard : shards_) {
+      lock_guard<mutex> lck(shard.mtx);
+      for (const auto& id_req : shard.reqs) {
+        const InFlightReq& req = *id_req.second;
+        entries.push_back(
+          Entry{req.key, req.op, req.submit_time, req.attempts});
+      }
+    }
+    sort(entries.begin(), entries.end(),
+         [](const Entry& a, const Entry& b) {
+           return a.submit_time < b.submit_time;
+         });
+    return entries;
+  }
+
+  // Cancels the requests submitted before 'time' and returns how many.
+  int Cancel(steady_clock::time_point time) {
+    int count = 0;
+    for (Shard& shard : shards_) {
+      lock_guard<mutex> lck(shard.mtx);
+      for (const auto& id_req : shard.reqs) {
+        InFlightReq *req = id_req.second;
+        if (req->submit_time < time && !req->cancelled.exchange(true)) {
+          ++count;
+        }
+      }
+    }
+    return count;
+  }
+
+ private:
+  static constexpr int kNumShards = 16;
+
+  struct Shard {
+    mutex mtx;
+    map<int64_t, InFlightReq *> reqs;
+  };
+
+  Shard shards_[kNumShards];
+  atomic<int64_t> next_id_{0};
+};
+static InFlightTable g_in_flight;
+
+// Requests cancelled by the stall watchdog.
+static atomic<int64_t> g_cancelled_requests{0};
+
+// "in flight 153: <0.1s 120, <1s 30, <10s 2, <60s 1, >=60s 0".
+static string FormatInFlightAges() {
+  static const double kBoundsSec[] = {0.1, 1, 10, 60};
+  static const char *const kBoundNames[] = {"0.1s", "1s", "10s", "60s"};
+  const int num_bounds = sizeof(kBoundsSec) / sizeof(kBoundsSec[0]);
+  const vector<InFlightTable::Entry> entries = g_in_flight.GetEntries();
+  const steady_clock::time_point now = steady_clock::now();
+  int counts[num_bounds + 1] = {};
+  for (const InFlightTable::Entry& entry : entries) {
+    const double age_sec =
+      duration_cast<duration<double>>(now - entry.submit_time).count();
+    int bucket = 0;
+    while (bucket < num_bounds && age_sec >= kBoundsSec[bucket]) {
+      ++bucket;
+    }
+    ++counts[bucket];
+  }
+  ostringstream out;
+  out << "in flight " << entries.size() << ":";
+  for (int ii = 0; ii < num_bounds; ++ii) {
+    out << " <" << kBoundNames[ii] << " " << counts[ii] << ",";
+  }
+  out << " >=" << kBoundNames[num_bounds - 1] << " " << counts[num_bounds];
+  return out.str();
+}
+
+// Context of a single request passed through the async APIs.
+class ReqCtx : public Aws::Client::AsyncCallerContext {
+ public:
+  // 'endpoint' is the index of the endpoint the request was routed to, or -1
+  // if it was not routed.
+  explicit ReqCtx(const Ctx *ctx,
+                  int endpoint = -1,
+                  shared_ptr<InFlightReq> in_flight = nullptr)
+  : ctx_(ctx), endpoint_(endpoint), submit_time_(steady_clock::now()),
+    in_flight_(move(in_flight)) {}
+
+  const Ctx *ctx() const { return ctx_; }
+  int endpoint() const { return endpoint_; }
+
+  bool cancelled() const { return in_flight_ && in_flight_->cancelled; }
+
+  int64_t ElapsedUs() const {
+    return duration_cast<microseconds>(
+      steady_clock::now() - submit_time_).count();
+  }
+
+ private:
+  const Ctx *const ctx_;
+  const int endpoint_;
+  const steady_clock::time_point submit_time_;
+  const shared_ptr<InFlightReq> in_flight_;
+};
+
+// Accounts a successfully completed request.
+static void RecordCompletion(int64_t latency_us, int64_t bytes) {
+  g_latency.Add(latency_us);
+  ++g_done_obj;
+  g_done_bytes += bytes;
+}
+
+// Accounts a successfully completed async request.
+static void RecordRequest(const ReqCtx& req_ctx, int64_t bytes) {
+  const int64_t latency_us = req_ctx.ElapsedUs();
+  RecordCompletion(latency_us, bytes);
+  if (req_ctx.endpoint() >= 0) {
+    EndEndpointRequest(req_ctx.endpoint(), latency_us);
+  }
+}
+
+// Accounts a successfully completed async request and releases its slot.
+static void CompleteRequest(const ReqCtx& req_ctx, int64_t bytes) {
+  RecordRequest(req_ctx, bytes);
+  req_ctx.ctx()->ReleaseSlot();
+}
+
+// Accounts a request cancelled by the stall watchdog or by a stopping
+// program, which does not count as completed.
+static void DropCancelledRequest(int endpoint) {
+  ++g_cancelled_requests;
+  RefundThrottle(ObjSize());
+  if (endpoint >= 0) {
+    --g_endpoint_stats[endpoint]->outstanding;
+  }
+}
+
+template<typename Error>
+static void ExitOnError(const Error& error) {
+  cerr << "ERROR: " << error.GetExceptionName() << ": "
+    << error.GetMessage() << endl;
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+// io_uring HTTP client
+//-----------------------------------------------------------------------------
+
+// Incremental HTTP/1.1 response parser. Body bytes are passed to the sink as
+// they are parsed, the status and headers are stored in 'response' unless it
+// is null.
+class HttpResponseParser {
+ public:
+  using BodySink = function<bool(const char *data, size_t len)>;
+
+  HttpResponseParser(bool head_request,
+                     Aws::Http::HttpResponse *response,
+                     const BodySink& sink)
+  : head_request_(head_request), response_(response), sink_(sink) {}
+
+  // Returns false on a malformed response or when the sink fails.
+  bool Parse(const char *data, size_t len) {
+    while (len > 0 && state_ != kDone) {
+      if (state_ == kBody || state_ == kChunkData || state_ == kBodyToEof) {
+        size_t num = len;
+        if (state_ != kBodyToEof) {
+          num = min<uint64_t>(len, remaining_);
+          remaining_ -= num;
+        }
+        if (!sink_(data, num)) {
+          return false;
+        }
+        data += num;
+        len -= num;
+        if (state_ == kBody && remaining_ == 0) {
+          state_ = kDone;
+        } else if (state_ == kChunkData && remaining_ == 0) {
+          state_ = kChunkDataEnd;
+        }
+        continue;
+      }
+
+      // Line-oriented states.
+      const char *eol = static_cast<const char *>(memchr(data, '\n', len));
+      const size_t num = eol ? eol - data + 1 : len;
+      line_.append(data, num);
+      data += num;
+      len -= num;
+      if (line_.size() > 65536) {
+        return false;
+      }
+      if (!eol) {
+        continue;
+      }
+      line_.resize(line_.size() - 1);
+      if (!line_.empty() && line_.back() == '\r') {
+        line_.resize(line_.size() - 1);
+      }
+      if (!ParseLine()) {
+        return false;
+      }
+      line_.clear();
+    }
+    return true;
+  }
+
+  // Called when the server closes the connection. Returns whether the
+  // response is complete.
+  bool Eof() {
+    if (state_ == kBodyToEof) {
+      state_ = kDone;
+    }
+    keep_alive_ = false;
+    return state_ == kDone;
+  }
+
+  bool done() const { return state_ == kDone; }
+  bool keep_alive() const { return keep_alive_; }
+  int status() const { return status_; }
+
+ private:
+  enum State {
+    kStatusLine, kHeader, kBody, kChunkSize, kChunkData, kChunkDataEnd,
+    kTrailer, kBodyToEof, kDone
+  };
+
+  bool ParseLine() {
+    switch (state_) {
+      case kStatusLine: {
+        // HTTP/1.1 200 OK
+        if (line_.compare(0, 5, "HTTP/") != 0) {
+          return false;
+        }
+        const size_t sp = line_.find(' ');
+        if (sp == string::npos) {
+          return false;
+        }
+        status_ = atoi(line_.c_str() + sp + 1);
+        keep_alive_ = line_.compare(0, 8, "HTTP/1.0") != 0;
+        state_ = kHeader;
+        return status_ >= 100;
+      }
+      case kHeader: {
+        if (!line_.empty()) {
+          const size_t colon = line_.find(':');
+          if (colon == string::npos) {
+            return false;
+          }
+          Aws::String name(line_.c_str(), colon);
+          for (char& c : name) {
+            c = tolower(c);
+          }
+          const size_t val = line_.find_first_not_of(" \t", colon + 1);
+          Aws::String value = val == string::npos ? "" :
+            Aws::String(line_.c_str() + val, line_.size() - val);
+          if (name == "content-length") {
+            content_length_ = strtoll(value.c_str(), nullptr, 10);
+          } else if (name == "transfer-encoding") {
+            chunked_ = value.find("chunked") != Aws::String::npos;
+          } else if (name == "connection") {
+            keep_alive_ = value.find("close") == Aws::String::npos;
+          }
+          if (status_ >= 200 && response_) {
+            response_->AddHeader(name, value);
+          }
+          return true;
+        }
+        // End of the headers.
+        if (status_ < 200) {
+          // 100 Continue and friends, the real response follows.
+          state_ = kStatusLine;
+          content_length_ = -1;
+          chunked_ = false;
+          return true;
+        }
+        if (response_) {
+          response_->SetResponseCode(
+            static_cast<Aws::Http::HttpResponseCode>(status_));
+        }
+        if (head_request_ || status_ == 204 || status_ == 304) {
+          state_ = kDone;
+        } else if (chunked_) {
+          state_ = kChunkSize;
+        } else if (content_length_ >= 0) {
+          remaining_ = content_length_;
+          state_ = remaining_ > 0 ? kBody : kDone;
+        } else {
+          state_ = kBodyToEof;
+        }
+        return true;
+      }
+      case kChunkSize: {
+        char *end;
+        remaining_ = strtoull(line_.c_str(), &end, 16);
+        if (end == line_.c_str()) {
+          return false;
+        }
+        state_ = remaining_ > 0 ? kChunkData : kTrailer;
+        return true;
+      }
+      case kChunkDataEnd:
+        state_ = kChunkSize;
+        return line_.empty();
+      case kTrailer:
+        if (line_.empty()) {
+          state_ = kDone;
+        }
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  const bool head_request_;
+  Aws::Http::HttpResponse *const response_;
+  const BodySink sink_;
+  State state_ = kStatusLine;
+  string line_;
+  int status_ = 0;
+  int64_t content_length_ = -1;
+  bool chunked_ = false;
+  bool keep_alive_ = true;
+  uint64_t remaining_ = 0;
+};
+
+#ifdef S3_PERF_IO_URING
+
+// A ring with a registered send buffer and a provided buffer ring for
+// multishot receives. A context serves one request at a time; contexts are
+// pooled instead of being tied to threads because the SDK's default executor
+// runs every request on a new thread.
+class UringContext {
+ public:
+  static constexpr unsigned kSendBufSize = 256 * 1024;
+  static constexpr unsigned kNumRecvBufs = 32;
+  static constexpr unsigned kRecvBufSize = 16 * 1024;
+  static constexpr int kRecvBufGroup = 0;
+
+  UringContext() {
+    int ret = io_uring_queue_init(8, &ring_, 0);
+    if (ret < 0) {
+      cerr << "ERROR: io_uring_queue_init: " << strerror(-ret) << endl;
+      exit(1);
+    }
+    send_buf_.resize(kSendBufSize);
+    struct iovec iov = { &send_buf_[0], kSendBufSize };
+    ret = io_uring_register_buffers(&ring_, &iov, 1);
+    if (ret < 0) {
+      cerr << "ERROR: io_uring_register_buffers: " << strerror(-ret) << endl;
+      exit(1);
+    }
+    recv_bufs_.resize(kNumRecvBufs * kRecvBufSize);
+    buf_ring_ = io_uring_setup_buf_ring(&ring_, kNumRecvBufs, kRecvBufGroup,
+                                        0, &ret);
+    if (!buf_ring_) {
+      cerr << "ERROR: io_uring_setup_buf_ring: " << strerror(-ret) << endl;
+      exit(1);
+    }
+    for (unsigned ii = 0; ii < kNumRecvBufs; ++ii) {
+      RecycleRecvBuf(ii);
+    }
+  }
+
+  ~UringContext() {
+    io_uring_free_buf_ring(&ring_, buf_ring_, kNumRecvBufs, kRecvBufGroup);
+    io_uring_queue_exit(&ring_);
+  }
+
+  io_uring *ring() { return &ring_; }
+  char *send_buf() { return &send_buf_[0]; }
+
+  const char *RecvBuf(unsigned bid) {
+    return &recv_bufs_[bid * kRecvBufSize];
+  }
+
+  void RecycleRecvBuf(unsigned bid) {
+    io_uring_buf_ring_add(buf_ring_, &recv_bufs_[bid * kRecvBufSize],
+                          kRecvBufSize, bid,
+                          io_uring_buf_ring_mask(kNumRecvBufs), 0);
+    io_uring_buf_ring_advance(buf_ring_, 1);
+  }
+
+ private:
+  io_uring ring_;
+  io_uring_buf_ring *buf_ring_;
+  vector<char> send_buf_;
+  vector<char> recv_bufs_;
+};
+
+// HTTP/1.1 client (no TLS) on io_uring. The request headers and the first
+// part of the body are sent from the registered buffer in one write that is
+// submitted together with the multishot receive of the response.
+class UringHttpClient : public Aws::Http::HttpClient {
+ public:
+  UringHttpClient(const Aws::Client::ClientConfiguration& config,
+                  const string& local_addr)
+  : max_conns_(max(1u, config.maxConnections)),
+    connect_timeout_ms_(config.connectTimeoutMs),
+    request_timeout_ms_(config.requestTimeoutMs),
+    local_addr_(local_addr) {}
+
+  ~UringHttpClient() {
+    for (auto& it : idle_conns_) {
+      for (int fd : it.second) {
+        close(fd);
+      }
+    }
+  }
+
+  shared_ptr<Aws::Http::HttpResponse> MakeRequest(
+    const shared_ptr<Aws::Http::HttpRequest>& request,
+    Aws::Utils::RateLimits::RateLimiterInterface *read_limiter,
+    Aws::Utils::RateLimits::RateLimiterInterface *write_limiter)
+      const override {
+
+    auto response = Aws::MakeShared<Aws::Http::Standard::StandardHttpResponse>(
+      "s3_perf", request);
+    const Aws::String url = request->GetURIString(true);
+    if (request->GetUri().GetScheme() != Aws::Http::Scheme::HTTP) {
+      return Fail(response, "io_uring client supports http only: " + url);
+    }
+
+    // http://authority/path?query
+    const size_t path_pos = url.find('/', url.find("://") + 3);
+    const Aws::String path = path_pos == Aws::String::npos ? "/" :
+                             url.substr(path_pos);
+    const Aws::String host = request->GetUri().GetAuthority();
+    const uint16_t port = request->GetUri().GetPort();
+
+    Aws::String header;
+    header.reserve(1024);
+    header += Aws::Http::HttpMethodMapper::GetNameForHttpMethod(
+      request->GetMethod());
+    header += " " + path + " HTTP/1.1\r\n";
+    for (const auto& it : request->GetHeaders()) {
+      if (it.first != "expect") {
+        header += it.first + ": " + it.second + "\r\n";
+      }
+    }
+    header += "\r\n";
+
+    const shared_ptr<Aws::IOStream>& body = request->GetContentBody();
+    if (body && !request->HasHeader("content-length")) {
+      return Fail(response, "io_uring client requires content-length");
+    }
+    if (header.size() > UringContext::kSendBufSize) {
+      return Fail(response, "request headers too large");
+    }
+
+    const unique_ptr<UringContext, function<void(UringContext *)>> ctx(
+      AcquireContext(), [this](UringContext *c) { ReleaseContext(c); });
+    int fd = AcquireConn(ctx.get(), host, port);
+    if (fd < 0) {
+      return Fail(response, "failed to connect to " + host + ": " +
+                  strerror(-fd));
+    }
+
+    const bool keep_alive = Exchange(ctx.get(), fd, header, request.get(),
+                                     body.get(), response.get());
+    ReleaseConn(host, port, fd, keep_alive);
+    return response;
+  }
+
+ private:
+  // user_data of the submitted operations.
+  enum { kOpConnect = 1, kOpTimeout, kOpSend, kOpRecv, kOpCancel };
+
+  static shared_ptr<Aws::Http::HttpResponse> Fail(
+    const shared_ptr<Aws::Http::HttpResponse>& response,
+    const Aws::String& msg) {
+
+    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
+    response->SetClientErrorMessage(msg);
+    return response;
+  }
+
+  // Waits for one completion. Returns false on timeout. A signal restarts
+  // the wait.
+  static bool WaitCqe(io_uring *ring, long timeout_ms, io_uring_cqe **cqe) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    int ret;
+    do {
+      ret = io_uring_submit_and_wait_timeout(ring, cqe, 1, &ts, nullptr);
+    } while (ret == -EINTR);
+    return ret >= 0;
+  }
+
+  // Sends the request and parses the response. Returns whether the
+  // connection can be reused.
+  bool Exchange(UringContext *ctx,
+                int fd,
+                const Aws::String& header,
+                Aws::Http::HttpRequest *request,
+                Aws::IOStream *body,
+                Aws::Http::HttpResponse *response) const {
+
+    io_uring *ring = ctx->ring();
+    const auto& sent_handler = request->GetDataSentEventHandler();
+    const auto& received_handler = request->GetDataReceivedEventHandler();
+    Aws::IOStream& response_body = response->GetResponseBody();
+    HttpResponseParser parser(
+      request->GetMethod() == Aws::Http::HttpMethod::HTTP_HEAD, response,
+      [&](const char *data, size_t len) {
+        response_body.write(data, len);
+        if (received_handler) {
+          received_handler(request, response, len);
+        }
+        return response_body.good();
+      });
+
+    // Fills the send buffer with the next part of the body.
+    char *const buf = ctx->send_buf();
+    size_t buf_len = header.size(), buf_off = 0;
+    memcpy(buf, header.data(), header.size());
+    bool body_done = !body;
+    if (body) {
+      body->clear();
+      body->seekg(0);
+    }
+    auto fill = [&] {
+      if (!body_done) {
+        body->read(buf + buf_len, UringContext::kSendBufSize - buf_len);
+        buf_len += body->gcount();
+        body_done = body->eof() || body->gcount() == 0;
+      }
+    };
+    auto submit_send = [&] {
+      io_uring_sqe *sqe = io_uring_get_sqe(ring);
+      io_uring_prep_write_fixed(sqe, fd, buf + buf_off, buf_len - buf_off, 0,
+                                0);
+      io_uring_sqe_set_data64(sqe, kOpSend);
+    };
+    auto arm_recv = [&] {
+      io_uring_sqe *sqe = io_uring_get_sqe(ring);
+      io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = UringContext::kRecvBufGroup;
+      io_uring_sqe_set_data64(sqe, kOpRecv);
+    };
+
+    fill();
+    submit_send();
+    arm_recv();
+    bool send_pending = true, recv_pending = true, cancel_pending = false;
+    bool send_done = false, sent_all = false, stray_data = false;
+    const char *error = nullptr;
+
+    // Runs until both directions are finished and all the operations on
+    // the socket have completed.
+    while (send_pending || recv_pending || cancel_pending) {
+      if (!error && !ContinueRequest(*request)) {
+        error = "request cancelled";
+      }
+      if (!error && send_done && parser.done() && recv_pending &&
+          !cancel_pending) {
+        // Stop the multishot receive before the connection is reused.
+        io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        io_uring_prep_cancel64(sqe, kOpRecv, 0);
+        io_uring_sqe_set_data64(sqe, kOpCancel);
+        cancel_pending = true;
+      }
+
+      // requestTimeoutMs bounds the time without any progress, like the
+      // low speed limit of the curl client.
+      io_uring_cqe *cqe;
+      if (!WaitCqe(ring, request_timeout_ms_, &cqe)) {
+        // Fail the pending operations so that they complete.
+        if (!error) {
+          error = "request timed out";
+        }
+        shutdown(fd, SHUT_RDWR);
+        continue;
+      }
+      const uint64_t op = io_uring_cqe_get_data64(cqe);
+      const int res = cqe->res;
+      const unsigned flags = cqe->flags;
+      io_uring_cqe_seen(ring, cqe);
+
+      if (op == kOpCancel) {
+        cancel_pending = false;
+      } else if (op == kOpSend) {
+        send_pending = false;
+        if (res <= 0) {
+          if (!error && !parser.done()) {
+            error = "send failed";
+          }
+          continue;
+        }
+        if (sent_handler) {
+          sent_handler(request, res);
+        }
+        buf_off += res;
+        if (buf_off == buf_len) {
+          buf_off = buf_len = 0;
+          fill();
+        }
+        if (buf_len > 0 && !error && !parser.done()) {
+          submit_send();
+          send_pending = true;
+        } else {
+          send_done = true;
+          // The server may answer before reading the whole body.
+          sent_all = buf_len == 0;
+        }
+      } else if (op == kOpRecv) {
+        if (res > 0) {
+          const unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+          stray_data |= parser.done();
+          if (!error && !parser.Parse(ctx->RecvBuf(bid), res)) {
+            error = "malformed response";
+          }
+          ctx->RecycleRecvBuf(bid);
+        } else if (res == 0) {
+          if (!error && !parser.Eof()) {
+            error = "connection closed";
+          }
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+          recv_pending = false;
+          // The multishot receive stops when it runs out of buffers.
+          if (res == -ENOBUFS && !error && !parser.done()) {
+            arm_recv();
+            recv_pending = true;
+          } else if (res < 0 && res != -ECANCELED && !error &&
+                     !parser.done()) {
+            error = "receive failed";
+          }
+        }
+      }
+
+      if (error && (send_pending || recv_pending) && !cancel_pending) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+
+    if (error) {
+      response->SetClientErrorType(
+        Aws::Client::CoreErrors::NETWORK_CONNECTION);
+      response->SetClientErrorMessage(error);
+      return false;
+    }
+    return sent_all && !stray_data && parser.keep_alive();
+  }
+
+  UringContext *AcquireContext() const {
+    {
+      lock_guard<mutex> lck(mtx_);
+      if (!free_contexts_.empty()) {
+        UringContext *ctx = free_contexts_.back().release();
+        free_contexts_.pop_back();
+        return ctx;
+      }
+    }
+    return new UringContext();
+  }
+
+  void ReleaseContext(UringContext *ctx) const {
+    lock_guard<mutex> lck(mtx_);
+    free_contexts_.emplace_back(ctx);
+  }
+
+  // Returns an idle connection to the host or opens a new one, waiting while
+  // max_conns_ connections are busy. Returns -errno on failure.
+  int AcquireConn(UringContext *ctx, const Aws::String& host,
+                  uint16_t port) const {
+    const string key = string(host.c_str()) + ":" + to_string(port);
+    {
+      unique_lock<mutex> lck(mtx_);
+      cond_.wait(lck, [this, &key] {
+        auto it = idle_conns_.find(key);
+        return (it != idle_conns_.end() && !it->second.empty()) ||
+               num_conns_ < max_conns_ || NumIdle() > 0;
+      });
+      auto it = idle_conns_.find(key);
+      if (it != idle_conns_.end() && !it->second.empty()) {
+        const int fd = it->second.back();
+        it->second.pop_back();
+        t_conn_trace.ready = steady_clock::now();
+        return fd;
+      }
+      if (num_conns_ >= max_conns_) {
+        // Close an idle connection to another host.
+        for (auto& other : idle_conns_) {
+          if (!other.second.empty()) {
+            close(other.second.back());
+            other.second.pop_back();
+            --num_conns_;
+            break;
+          }
+        }
+      }
+      ++num_conns_;
+    }
+
+    t_conn_trace.new_conn = true;
+    t_conn_trace.connect_start = steady_clock::now();
+    const int fd = Connect(ctx, host, port);
+    if (fd < 0) {
+      lock_guard<mutex> lck(mtx_);
+      --num_conns_;
+      cond_.notify_one();
+    }
+    t_conn_trace.ready = steady_clock::now();
+    return fd;
+  }
+
+  void ReleaseConn(const Aws::String& host, uint16_t port, int fd,
+                   bool keep_alive) const {
+    lock_guard<mutex> lck(mtx_);
+    if (keep_alive) {
+      idle_conns_[string(host.c_str()) + ":" + to_string(port)].push_back(fd);
+    } else {
+      close(fd);
+      --num_conns_;
+    }
+    cond_.notify_one();
+  }
+
+  int NumIdle() const {
+    int num = 0;
+    for (const auto& it : idle_conns_) {
+      num += it.second.size();
+    }
+    return num;
+  }
+
+  int Connect(UringContext *ctx, const Aws::String& host,
+              uint16_t port) const {
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res)) {
+      return -EHOSTUNREACH;
+    }
+    int ret = -ECONNREFUSED;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+      const int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        ret = -errno;
+        continue;
+      }
+      const int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      TuneSocket(fd);
+      if (const int err = BindLocalAddr(fd, ai->ai_family, local_addr_)) {
+        close(fd);
+        ret = -err;
+        continue;
+      }
+
+      // The linked timeout cancels the connect. Both post a completion.
+      struct __kernel_timespec ts;
+      ts.tv_sec = connect_timeout_ms_ / 1000;
+      ts.tv_nsec = (connect_timeout_ms_ % 1000) * 1000000;
+      io_uring_sqe *sqe = io_uring_get_sqe(ctx->ring());
+      io_uring_prep_connect(sqe, fd, ai->ai_addr, ai->ai_addrlen);
+      io_uring_sqe_set_data64(sqe, kOpConnect);
+      sqe->flags |= IOSQE_IO_LINK;
+      sqe = io_uring_get_sqe(ctx->ring());
+      io_uring_prep_link_timeout(sqe, &ts, 0);
+      io_uring_sqe_set_data64(sqe, kOpTimeout);
+      io_uring_submit(ctx->ring());
+      for (int num_cqes = 0; num_cqes < 2; ++num_cqes) {
+        io_uring_cqe *cqe;
+        int err;
+        do {
+          err = io_uring_wait_cqe(ctx->ring(), &cqe);
+        } while (err == -EINTR);
+        if (err < 0) {
+          ret = err;
+          break;
+        }
+        if (io_uring_cqe_get_data64(cqe) == kOpConnect) {
+          ret = cqe->res == -ECANCELED ? -ETIMEDOUT : cqe->res;
+        }
+        io_uring_cqe_seen(ctx->ring(), cqe);
+      }
+      if (ret == 0) {
+        freeaddrinfo(res);
+        return fd;
+      }
+      close(fd);
+    }
+    freeaddrinfo(res);
+    return ret;
+  }
+
+  const int max_conns_;
+  const long connect_timeout_ms_;
+  const long request_timeout_ms_;
+  const string local_addr_;
+  mutable mutex mtx_;
+  mutable condition_variable cond_;
+  mutable map<string, vector<int>> idle_conns_;
+  mutable int num_conns_{0};
+  mutable vector<unique_ptr<UringContext>> free_contexts_;
+};
+
+#endif // S3_PERF_IO_URING
+
+//-----------------------------------------------------------------------------
+// HTTP client
+//-----------------------------------------------------------------------------
+
+// CurlHttpClient that notes new connections and the end of their handshake
+// in t_conn_trace.
+class BenchCurlHttpClient : public Aws::Http::CurlHttpClient {
+ public:
+  BenchCurlHttpClient(const Aws::Client::ClientConfiguration& config,
+                      const string& local_addr)
+  : CurlHttpClient(config),
+    interface_(local_addr.empty() ? "" : "host!" + local_addr) {}
+
+ protected:
+  void OverrideOptionsOnConnectionHandle(CURL *handle) const override {
+    curl_easy_setopt(handle, CURLOPT_SOCKOPTFUNCTION, SockOpt);
+    // The SDK checks for cancellation only when data moves, the progress
+    // callback also runs about once a second on a silent connection.
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, XferInfo);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, t_http_request);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+    if (!interface_.empty()) {
+      curl_easy_setopt(handle, CURLOPT_INTERFACE, interface_.c_str());
+    }
+#if LIBCURL_VERSION_NUM >= 0x075000
+    // Older libcurl has no hook at the end of the handshake, so the
+    // handshake time of new connections counts as transfer time.
+    curl_easy_setopt(handle, CURLOPT_PREREQFUNCTION, PreReq);
+#endif
+  }
+
+ private:
+  // Called for every new socket.
+  static int SockOpt(void *data, curl_socket_t fd, curlsocktype purpose) {
+    t_conn_trace.new_conn = true;
+    t_conn_trace.connect_start = steady_clock::now();
+    return CurlTuneSocket(data, fd, purpose);
+  }
+
+  // Aborts the transfer once the request is cancelled.
+  static int XferInfo(void *data, curl_off_t, curl_off_t, curl_off_t,
+                      curl_off_t) {
+    const auto *request = static_cast<const Aws::Http::HttpRequest *>(data);
+    if (!request) {
+      return 0;
+    }
+    const Aws::Http::ContinueRequestHandler& handler =
+      request->GetContinueRequestHandler();
+    return handler && !handler(request) ? 1 : 0;
+  }
+
+  // Called when the connection is ready, right before sending the request.
+  static int PreReq(void *, char *, char *, int, int) {
+    t_conn_trace.ready = steady_clock::now();
+    return CURL_PREREQFUNC_OK;
+  }
+
+  // CURLOPT_INTERFACE binding the connections to the source address.
+  const string interface_;
+};
+
+// Accounts the connection setup of the HTTP request the thread just made.
+static void RecordConnTrace() {
+  const ConnTrace& trace = t_conn_trace;
+  if (trace.new_conn) {
+    ++g_new_conns;
+    g_handshake_latency.Add(duration_cast<microseconds>(
+      trace.ready - trace.connect_start).count());
+  } else {
+    ++g_reused_conns;
+  }
+  g_transfer_latency.Add(ElapsedUs(trace.ready));
+}
+
+// Forwards requests to the curl or io_uring client and instruments them.
+class BenchHttpClient : public Aws::Http::HttpClient {
+ public:
+  BenchHttpClient(const Aws::Client::ClientConfiguration& config,
+                  const string& local_addr) {
+#ifdef S3_PERF_IO_URING
+    if (FLAGS_http_client == "io_uring") {
+      client_ = Aws::MakeShared<UringHttpClient>("s3_perf", config,
+                                                 local_addr);
+      return;
+    }
+#endif
+    client_ = Aws::MakeShared<BenchCurlHttpClient>("s3_perf", config,
+                                                   local_addr);
+  }
+
+  shared_ptr<Aws::Http::HttpResponse> MakeRequest(
+    const shared_ptr<Aws::Http::HttpRequest>& request,
+    Aws::Utils::RateLimits::RateLimiterInterface *read_limiter,
+    Aws::Utils::RateLimits::RateLimiterInterface *write_limiter)
+      const override {
+
+    AllocStageScope alloc_stage(kAllocStageHttp);
+    t_conn_trace = ConnTrace();
+    t_conn_trace.ready = t_conn_trace.connect_start = steady_clock::now();
+    t_stream_trace = StreamTrace();
+    t_http_request = request.get();
+    shared_ptr<Aws::Http::HttpResponse> response =
+      client_->MakeRequest(request, read_limiter, write_limiter);
+    t_http_request = nullptr;
+    const Aws::Http::ContinueRequestHandler& handler =
+      request->GetContinueRequestHandler();
+    t_request_cancelled = handler && !handler(request.get());
+    if (g_prewarming) {
+      if (t_conn_trace.new_conn) {
+        ++g_prewarm_conns;
+      }
+      return response;
+    }
+    RecordConnTrace();
+    RecordPartitionAttempt(*response);
+    const StreamTrace& stream = t_stream_trace;
+    if (stream.bytes > 0) {
+      RecordStream(
+        duration_cast<microseconds>(stream.first_byte -
+                                    t_conn_trace.ready).count(),
+        duration_cast<microseconds>(stream.last_byte -
+                                    stream.first_byte).count(),
+        stream.bytes);
+    }
+    return response;
+  }
+
+ private:
+  shared_ptr<Aws::Http::HttpClient> client_;
+};
+
+// Replaces the SDK's default HTTP client factory to instrument the requests.
+class BenchHttpClientFactory : public Aws::Http::HttpClientFactory {
+ public:
+  shared_ptr<Aws::Http::HttpClient> CreateHttpClient(
+    const Aws::Client::ClientConfiguration& config) const override {
+
+    return Aws::MakeShared<BenchHttpClient>("s3_perf", config,
+                                            t_client_local_addr);
+  }
+
+  shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(
+    const Aws::String& uri,
+    Aws::Http::HttpMethod method,
+    const Aws::IOStreamFactory& stream_factory) const override {
+
+    return CreateHttpRequest(Aws::Http::URI(uri), method, stream_factory);
+  }
+
+  shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(
+    const Aws::Http::URI& uri,
+    Aws::Http::HttpMethod method,
+    const Aws::IOStreamFactory& stream_factory) const override {
+
+    auto request = Aws::MakeShared<Aws::Http::Standard::StandardHttpRequest>(
+      "s3_perf", uri, method);
+    request->SetResponseStreamFactory(stream_factory);
+    // The SDK adds the headers and signs the request next. The request
+    // signed handler installed by SetRequestHandlers() ends the stage, under
+    // the same flag.
+    if (FLAGS_alloc_profile) {
+      t_alloc_stage = kAllocStageSign;
+    }
+    return request;
+  }
+
+  void InitStaticState() override {
+    Aws::Http::CurlHttpClient::InitGlobalState();
+  }
+
+  void CleanupStaticState() override {
+    Aws::Http::CurlHttpClient::CleanupGlobalState();
+  }
+};
+
+// Retries like the SDK's strategy, except for cancelled requests, which
+// fail with retryable network errors.
+class BenchRetryStrategy : public Aws::Client::RetryStrategy {
+ public:
+  explicit BenchRetryStrategy(
+    shared_ptr<Aws::Client::RetryStrategy> strategy)
+  : strategy_(move(strategy)) {}
+
+  bool ShouldRetry(
+    const Aws::Client::AWSError<Aws::Client::CoreErrors>& error,
+    long attempted_retries) const override {
+
+    return !t_request_cancelled &&
+      strategy_->ShouldRetry(error, attempted_retries);
+  }
+
+  long CalculateDelayBeforeNextRetry(
+    const Aws::Client::AWSError<Aws::Client::CoreErrors>& error,
+    long attempted_retries) const override {
+
+    return strategy_->CalculateDelayBeforeNextRetry(error,
+                                                    attempted_retries);
+  }
+
+  long GetMaxAttempts() const override {
+    return strategy_->GetMaxAttempts();
+  }
+
+ private:
+  const shared_ptr<Aws::Client::RetryStrategy> strategy_;
+};
+
+static Aws::Client::ClientConfiguration ClientConfig(int endpoint = 0) {
+  Aws::Client::ClientConfiguration clientConfig;
+  //clientConfig.followRedirects = true;
+  clientConfig.region = FLAGS_region.c_str();
+  clientConfig.maxConnections = FLAGS_num_connections;
+  if (!g_endpoints[endpoint].empty()) {
+    clientConfig.endpointOverride = g_endpoints[endpoint].c_str();
+  }
+  clientConfig.scheme = FLAGS_scheme == "http" ? Aws::Http::Scheme::HTTP :
+                                                 Aws::Http::Scheme::HTTPS;
+  if (clientConfig.retryStrategy) {
+    clientConfig.retryStrategy = Aws::MakeShared<BenchRetryStrategy>(
+      "s3_perf", clientConfig.retryStrategy);
+  }
+  return clientConfig;
+}
+
+// One client, with its own connection pool, per endpoint.
+typedef vector<shared_ptr<Aws::S3::S3Client>> ClientGroup;
+
+// With 'pooled', each client runs its requests on its own pool of
+// num_connections threads instead of a thread per request. The connections
+// of the clients are bound to 'local_addr' unless it is empty.
+static ClientGroup MakeClientGroup(const string& local_addr,
+                                   bool pooled = false) {
+  t_client_local_addr = local_addr;
+  ClientGroup group;
+  for (size_t ii = 0; ii < g_endpoints.size(); ++ii) {
+    Aws::Client::ClientConfiguration config = ClientConfig(ii);
+    if (pooled) {
+      config.executor =
+        Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>(
+          "s3_perf", FLAGS_num_connections);
+    }
+    group.push_back(Aws::MakeShared<Aws::S3::S3Client>("s3_perf", config));
+  }
+  t_client_local_addr.clear();
+  return group;
+}
+
+// Clients of the threads of --client=s3: the --client_shards shared by all
+// threads, or one client group per thread for the current stage iteration.
+static vector<ClientGroup> g_s3_clients;
+
+static const ClientGroup& GetS3Client(int thread_num) {
+  return g_s3_clients[thread_num % g_s3_clients.size()];
+}
+
+// Opens num_connections connections of every client with concurrent HEAD
+// requests, spread over the buckets so that every bucket host gets at least
+// one. Their outcome does not matter.
+static void Prewarm(const vector<ClientGroup>& groups) {
+  vector<shared_ptr<Aws::S3::S3Client>> clients;
+  for (const ClientGroup& group : groups) {
+    clients.insert(clients.end(), group.begin(), group.end());
+  }
+  const steady_clock::time_point t0 = steady_clock::now();
+  const int64_t new_conns0 = g_prewarm_conns;
+  g_prewarming = true;
+  mutex mtx;
+  condition_variable cond;
+  const int per_client =
+    max<int>(FLAGS_num_connections, g_buckets.size());
+  int pending = clients.size() * per_client;
+  vector<Aws::S3::Model::HeadObjectRequest> requests(g_buckets.size());
+  for (size_t ii = 0; ii < g_buckets.size(); ++ii) {
+    requests[ii].SetBucket(g_buckets[ii]);
+    requests[ii].SetKey(ObjKey(0, 0));
+  }
+  for (const shared_ptr<Aws::S3::S3Client>& client : clients) {
+    for (int ii = 0; ii < per_client; ++ii) {
+      client->HeadObjectAsync(
+        requests[ii % requests.size()],
+        [&](const Aws::S3::S3Client *,
+            const Aws::S3::Model::HeadObjectRequest&,
+            const Aws::S3::Model::HeadObjectOutcome&,
+            const shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+          lock_guard<mutex> lck(mtx);
+          if (--pending == 0) {
+            cond.notify_one();
+          }
+        });
+    }
+  }
+  unique_lock<mutex> lck(mtx);
+  cond.wait(lck, [&pending] { return pending == 0; });
+  g_prewarming = false;
+  const nanoseconds elapsed = steady_clock::now() - t0;
+  g_prewarm_ns += elapsed.count();
+  cout << "PREWARM: " << (g_prewarm_conns - new_conns0)
+       << " new connections in "
+       << duration_cast<duration<double>>(elapsed).count() << " seconds"
+       << endl;
+}
+
+// Sets up the clients of a stage iteration before its timing starts.
+static void SetUpS3Clients() {
+  if (FLAGS_client != "s3") {
+    return;
+  }
+  if (FLAGS_client_shards <= 0) {
+    for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+      g_s3_clients.push_back(MakeClientGroup(LocalAddr(ii)));
+    }
+  }
+  if (FLAGS_prewarm) {
+    Prewarm(g_s3_clients);
+  }
+}
+
+static void TearDownS3Clients() {
+  if (FLAGS_client_shards <= 0) {
+    g_s3_clients.clear();
+  }
+}
+
+// Installs the per-request SDK hooks used by the instrumentation, and
+// registers the request in g_in_flight.
+template<typename Request>
+static shared_ptr<InFlightReq> SetRequestHandlers(Request *request,
+                                                  int partition,
+                                                  const char *op) {
+  shared_ptr<InFlightReq> in_flight = g_in_flight.Add(request->GetKey(), op);
+  InFlightReq *req = in_flight.get();
+  // The handlers are owned by the request, which holds the table entry.
+  request->SetRequestSignedHandler(
+    [partition, in_flight](const Aws::Http::HttpRequest&) {
+      // Runs on the thread that sends the attempt next.
+      t_partition = partition;
+      ++in_flight->attempts;
+      if (FLAGS_alloc_profile) {
+        t_alloc_stage = kAllocStageSdk;
+      }
+    });
+  // Checked by the SDK while the request is sent and received, so that the
+  // stall watchdog and a stopping program can cancel it.
+  request->SetContinueRequestHandler([req](const Aws::Http::HttpRequest *) {
+    return !req->cancelled;
+  });
+  return in_flight;
+}
+
+//-----------------------------------------------------------------------------
+// System resource sampling
+//-----------------------------------------------------------------------------
+
+struct CpuTimes {
+  uint64_t total = 0;
+  uint64_t iowait = 0;
+  uint64_t softirq = 0;
+};
+
+struct SysSample {
+  uint64_t rx_bytes = 0;
+  uint64_t tx_bytes = 0;
+  uint64_t out_segs = 0;
+  uint64_t retrans_segs = 0;
+  // Index 0 is the aggregate "cpu" line, followed by the individual CPUs.
+  vector<CpuTimes> cpus;
+  uint64_t mem_total_kb = 0;
+  uint64_t mem_avail_kb = 0;
+};
+
+// Returns the rx and tx bytes of every interface.
+static map<string, pair<uint64_t, uint64_t>> ReadNetDevBytes() {
+  map<string, pair<uint64_t, uint64_t>> bytes;
+  ifstream in("/proc/net/dev");
+  string line;
+  while (getline(in, line)) {
+    const size_t colon = line.find(':');
+    if (colon == string::npos) {
+      // Header lines.
+      continue;
+    }
+    string name = line.substr(0, colon);
+    name.erase(0, name.find_first_not_of(' '));
+    // rx: bytes packets errs drop fifo frame compressed multicast, then tx.
+    istringstream fields(line.substr(colon + 1));
+    uint64_t val[9] = {0};
+    for (int ii = 0; ii < 9 && fields >> val[ii]; ++ii) {
+    }
+    bytes[name] = make_pair(val[0], val[8]);
+  }
+  return bytes;
+}
+
+static void ReadNetDev(SysSample *sample) {
+  for (const auto& it : ReadNetDevBytes()) {
+    if (FLAGS_nic.empty() ? it.first == "lo" : it.first != FLAGS_nic) {
+      continue;
+    }
+    sample->rx_bytes += it.second.first;
+    sample->tx_bytes += it.second.second;
+  }
+}
+
+static void ReadNetSnmp(SysSample *sample) {
+  // The file has pairs of "Tcp: <names>" and "Tcp: <values>" lines.
+  ifstream in("/proc/net/snmp");
+  string names, values;
+  while (getline(in, names) && getline(in, values)) {
+    if (names.compare(0, 4, "Tcp:") != 0) {
+      continue;
+    }
+    istringstream n(names.substr(4)), v(values.substr(4));
+    string name;
+    int64_t val;
+    while (n >> name && v >> val) {
+      if (name == "OutSegs") {
+        sample->out_segs = val;
+      } else if (name == "RetransSegs") {
+        sample->retrans_segs = val;
+      }
+    }
+  }
+}
+
+static void ReadStat(SysSample *sample) {
+  ifstream in("/proc/stat");
+  string line;
+  while (getline(in, line) && line.compare(0, 3, "cpu") == 0) {
+    // cpu user nice system idle iowait irq softirq steal ...
+    istringstream fields(line);
+    string name;
+    fields >> name;
+    CpuTimes cpu;
+    uint64_t val;
+    for (int ii = 0; fields >> val; ++ii) {
+      cpu.total += val;
+      if (ii == 4) {
+        cpu.iowait = val;
+      } else if (ii == 6) {
+        cpu.softirq = val;
+      }
+    }
+    sample->cpus.push_back(cpu);
+  }
+}
+
+static void ReadMemInfo(SysSample *sample) {
+  ifstream in("/proc/meminfo");
+  string name;
+  uint64_t val;
+  string unit;
+  while (in >> name >> val >> unit) {
+    if (name == "MemTotal:") {
+      sample->mem_total_kb = val;
+    } else if (name == "MemAvailable:") {
+      sample->mem_avail_kb = val;
+    }
+  }
+}
+
+static SysSample TakeSysSample() {
+  SysSample sample;
+  ReadNetDev(&sample);
+  ReadNetSnmp(&sample);
+  ReadStat(&sample);
+  ReadMemInfo(&sample);
+  return sample;
+}
+
+static int NicSpeedMbps() {
+  if (FLAGS_nic_speed_mbps > 0 || FLAGS_nic.empty()) {
+    return FLAGS_nic_speed_mbps;
+  }
+  ifstream in("/sys/class/net/" + FLAGS_nic + "/speed");
+  int speed = 0;
+  // Virtual interfaces report -1 or fail the read.
+  return (in >> speed) && speed > 0 ? speed : 0;
+}
+
+// Formats the resource usage between two samples and appends warnings for
+// the resources that look saturated.
+static string FormatSysDelta(const SysSample& s0,
+                             const SysSample& s1,
+                             double time_sec) {
+  const double rx_mb = (s1.rx_bytes - s0.rx_bytes) / 1048576.0 / time_sec;
+  const double tx_mb = (s1.tx_bytes - s0.tx_bytes) / 1048576.0 / time_sec;
+  const uint64_t out_segs = s1.out_segs - s0.out_segs;
+  const double retrans_pct = out_segs == 0 ? 0 :
+    100.0 * (s1.retrans_segs - s0.retrans_segs) / out_segs;
+
+  // Percent of one CPU spent in softirq and iowait, aggregate and for the
+  // busiest CPU. Network softirqs often pin a single core.
+  auto pct = [](const CpuTimes& c0, const CpuTimes& c1, uint64_t CpuTimes::*f) {
+    const uint64_t total = c1.total - c0.total;
+    return total == 0 ? 0 : 100.0 * (c1.*f - c0.*f) / total;
+  };
+  double softirq_pct = 0, iowait_pct = 0, max_softirq_pct = 0;
+  if (!s0.cpus.empty() && s0.cpus.size() == s1.cpus.size()) {
+    softirq_pct = pct(s0.cpus[0], s1.cpus[0], &CpuTimes::softirq);
+    iowait_pct = pct(s0.cpus[0], s1.cpus[0], &CpuTimes::iowait);
+    for (size_t ii = 1; ii < s1.cpus.size(); ++ii) {
+      max_softirq_pct = max(max_softirq_pct,
+                            pct(s0.cpus[ii], s1.cpus[ii], &CpuTimes::softirq));
+    }
+  }
+  const double mem_avail_mb = s1.mem_avail_kb / 1024.0;
+
+  ostringstream out;
+  out << "net rx " << rx_mb << " tx " << tx_mb << " MB/sec, retrans "
+      << retrans_pct << "%, softirq " << softirq_pct << "% (max cpu "
+      << max_softirq_pct << "%), iowait " << iowait_pct << "%, mem avail "
+      << mem_avail_mb << " MB";
+
+  const int speed_mbps = NicSpeedMbps();
+  if (speed_mbps > 0 &&
+      max(rx_mb, tx_mb) * 8 * 1.048576 >= 0.9 * speed_mbps) {
+    out << " [NIC LINE RATE]";
+  }
+  if (retrans_pct >= 1) {
+    out << " [RETRANSMITS]";
+  }
+  if (max_softirq_pct >= 90) {
+    out << " [SOFTIRQ SATURATED]";
+  }
+  if (iowait_pct >= 20) {
+    out << " [IOWAIT]";
+  }
+  if (s1.mem_total_kb > 0 && s1.mem_avail_kb * 20 < s1.mem_total_kb) {
+    out << " [MEMORY PRESSURE]";
+  }
+  return out.str();
+}
+
+// Prints the throughput of the running stage iteration every
+// FLAGS_report_interval_sec seconds, optionally followed by the system
+// resource usage over the same interval.
+class IntervalReporter {
+ public:
+  explicit IntervalReporter(const string& operation)
+  : operation_(operation) {
+    if (FLAGS_report_interval_sec > 0) {
+      thread_ = thread(&IntervalReporter::Run, this);
+    }
+  }
+
+  ~IntervalReporter() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      unique_lock<mutex> lck(mtx_);
+      stop_ = true;
+      cond_.notify_one();
+    }
+    thread_.join();
+  }
+
+ private:
+  void Run() {
+    const high_resolution_clock::time_point t0 = high_resolution_clock::now();
+    high_resolution_clock::time_point prev_t = t0;
+    // Bytes in flight are included unless the client only accounts
+    // completed objects.
+    const bool moved_bytes = CountsMovedBytes();
+    int64_t prev_obj = g_done_obj;
+    int64_t prev_bytes = moved_bytes ? MovedBytes() : g_done_bytes.load();
+    SysSample prev_sample;
+    if (FLAGS_sys_stats) {
+      prev_sample = TakeSysSample();
+    }
+
+    unique_lock<mutex> lck(mtx_);
+    for (int ii = 1; ; ++ii) {
+      // Wake up at fixed offsets from the start so that the intervals don't
+      // drift with the time spent sampling.
+      if (cond_.wait_until(lck, t0 + seconds(ii * FLAGS_report_interval_sec),
+                           [this] { return stop_; })) {
+        return;
+      }
+      const high_resolution_clock::time_point t = high_resolution_clock::now();
+      const double time_sec =
+        duration_cast<duration<double>>(t - prev_t).count();
+      const int64_t obj = g_done_obj;
+      const int64_t bytes = moved_bytes ? MovedBytes() : g_done_bytes.load();
+
+      ostringstream out;
+      out << operation_ << " "
+          << duration_cast<duration<double>>(t - t0).count() << "s: "
+          << ((bytes - prev_bytes) / 1048576.0 / time_sec) << " MB/sec, "
+          << ((obj - prev_obj) / time_sec) << " obj/sec";
+      if (FLAGS_client == "s3") {
+        out << " | " << FormatInFlightAges();
+      }
+      if (FLAGS_sys_stats) {
+        const SysSample sample = TakeSysSample();
+        out << " | " << FormatSysDelta(prev_sample, sample, time_sec);
+        prev_sample = sample;
+      }
+      cout << out.str() << endl;
+
+      prev_t = t;
+      prev_obj = obj;
+      prev_bytes = bytes;
+    }
+  }
+
+  const string operation_;
+  mutex mtx_;
+  condition_variable cond_;
+  bool stop_{false};
+  thread thread_;
+};
+
+// Returns the number of established TCP connections of this process, found by
+// matching the socket inodes of /proc/self/fd against /proc/net/tcp{,6}.
+static int CountOpenConnections() {
+  vector<uint64_t> inodes;
+  if (DIR *dir = opendir("/proc/self/fd")) {
+    char target[64];
+    while (const dirent *entry = readdir(dir)) {
+      const string path = string("/proc/self/fd/") + entry->d_name;
+      const ssize_t len = readlink(path.c_str(), target, sizeof(target) - 1);
+      unsigned long inode;
+      if (len > 0 &&
+          sscanf(string(target, len).c_str(), "socket:[%lu]", &inode) == 1) {
+        inodes.push_back(inode);
+      }
+    }
+    closedir(dir);
+  }
+  sort(inodes.begin(), inodes.end());
+
+  int count = 0;
+  for (const char *path : { "/proc/net/tcp", "/proc/net/tcp6" }) {
+    ifstream in(path);
+    string line;
+    getline(in, line);
+    while (getline(in, line)) {
+      // sl local_address rem_address st tx_queue:rx_queue tr:tm->when
+      // retrnsmt uid timeout inode
+      istringstream fields(line);
+      string skip, state;
+      uint64_t inode = 0;
+      fields >> skip >> skip >> skip >> state >> skip >> skip >> skip >> skip
+             >> skip >> inode;
+      // 01 is TCP_ESTABLISHED.
+      if (state == "01" &&
+          binary_search(inodes.begin(), inodes.end(), inode)) {
+        ++count;
+      }
+    }
+  }
+  return count;
+}
+
+// Samples the open connections of the process while a stage iteration runs
+// and prints their average and maximum when it ends.
+class ConnectionSampler {
+ public:
+  explicit ConnectionSampler(const string& operation)
+  : operation_(operation) {
+    if (FLAGS_conn_sample_ms > 0) {
+      thread_ = thread(&ConnectionSampler::Run, this);
+    }
+  }
+
+  ~ConnectionSampler() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      unique_lock<mutex> lck(mtx_);
+      stop_ = true;
+      cond_.notify_one();
+    }
+    thread_.join();
+    cout << operation_ << " open connections: avg "
+         << (num_samples_ ? (double)sum_ / num_samples_ : 0) << ", max "
+         << max_ << endl;
+  }
+
+ private:
+  void Run() {
+    unique_lock<mutex> lck(mtx_);
+    do {
+      const int count = CountOpenConnections();
+      sum_ += count;
+      max_ = max(max_, count);
+      ++num_samples_;
+    } while (!cond_.wait_for(lck, milliseconds(FLAGS_conn_sample_ms),
+                             [this] { return stop_; }));
+    AddSamplerCpu();
+  }
+
+  const string operation_;
+  mutex mtx_;
+  condition_variable cond_;
+  bool stop_{false};
+  int64_t sum_ = 0;
+  int max_ = 0;
+  int num_samples_ = 0;
+  thread thread_;
+};
+
+// Reports when no request completed for --stall_timeout_sec while requests
+// of the SDK clients are in flight, with the oldest of them, and cancels
+// them with --stall_cancel.
+class StallWatchdog {
+ public:
+  explicit StallWatchdog(const string& operation)
+  : operation_(operation), cancelled0_(g_cancelled_requests) {
+    if (FLAGS_stall_timeout_sec > 0) {
+      thread_ = thread(&StallWatchdog::Run, this);
+    }
+  }
+
+  ~StallWatchdog() {
+    if (thread_.joinable()) {
+      {
+        unique_lock<mutex> lck(mtx_);
+        stop_ = true;
+        cond_.notify_one();
+      }
+      thread_.join();
+    }
+    const int64_t cancelled = g_cancelled_requests - cancelled0_;
+    if (cancelled > 0) {
+      cout << operation_ << " cancelled: " << cancelled << " requests"
+           << endl;
+    }
+  }
+
+ private:
+  void Run() {
+    const seconds timeout(FLAGS_stall_timeout_sec);
+    int64_t prev_obj = g_done_obj;
+    steady_clock::time_point last_progress = steady_clock::now();
+    unique_lock<mutex> lck(mtx_);
+    while (!cond_.wait_for(lck, seconds(1), [this] { return stop_; })) {
+      const steady_clock::time_point now = steady_clock::now();
+      const int64_t obj = g_done_obj;
+      if (obj != prev_obj || now - last_progress < timeout) {
+        if (obj != prev_obj) {
+          prev_obj = obj;
+          last_progress = now;
+        }
+        continue;
+      }
+      // Reports again after another timeout without completions.
+      last_progress = now;
+      const vector<InFlightTable::Entry> entries = g_in_flight.GetEntries();
+      if (entries.empty()) {
+        continue;
+      }
+      ostringstream out;
+      out << operation_ << " STALL: no completion for "
+          << FLAGS_stall_timeout_sec << " seconds, " << entries.size()
+          << " requests in flight, oldest:" << endl;
+      for (size_t ii = 0; ii < entries.size() && ii < 10; ++ii) {
+        const InFlightTable::Entry& entry = entries[ii];
+        out << operation_ << "   " << entry.op << " " << entry.key << ": "
+            << duration_cast<duration<double>>(
+                 now - entry.submit_time).count()
+            << " s, " << entry.attempts << " attempts" << endl;
+      }
+      if (FLAGS_stall_cancel) {
+        out << operation_ << " STALL: cancelling "
+            << g_in_flight.Cancel(now - timeout) << " requests" << endl;
+      }
+      cout << out.str() << flush;
+    }
+  }
+
+  const string operation_;
+  const int64_t cancelled0_;
+  mutex mtx_;
+  condition_variable cond_;
+  bool stop_{false};
+  thread thread_;
+};
+
+// Interfaces holding the --local_addrs, without duplicates.
+static vector<string> g_local_addr_ifaces;
+
+// Resolves the interfaces of --local_addrs. Exits if an address is not
+// configured on this host.
+static void InitLocalAddrIfaces() {
+  ifaddrs *ifas;
+  if (getifaddrs(&ifas) < 0) {
+    cerr << "ERROR: getifaddrs: " << strerror(errno) << endl;
+    exit(1);
+  }
+  for (const string& addr : g_local_addrs) {
+    string iface;
+    for (const ifaddrs *ifa = ifas; ifa && iface.empty(); ifa = ifa->ifa_next) {
+      if (!ifa->ifa_addr) {
+        continue;
+      }
+      char host[NI_MAXHOST];
+      const int family = ifa->ifa_addr->sa_family;
+      if ((family == AF_INET || family == AF_INET6) &&
+          getnameinfo(ifa->ifa_addr,
+                      family == AF_INET ? sizeof(sockaddr_in) :
+                                          sizeof(sockaddr_in6),
+                      host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0 &&
+          addr == host) {
+        iface = ifa->ifa_name;
+      }
+    }
+    if (iface.empty()) {
+      cerr << "ERROR: no interface has the local address " << addr << endl;
+      exit(1);
+    }
+    if (find(g_local_addr_ifaces.begin(), g_local_addr_ifaces.end(),
+             iface) == g_local_addr_ifaces.end()) {
+      g_local_addr_ifaces.push_back(iface);
+    }
+  }
+  freeifaddrs(ifas);
+}
+
+// Prints the rx and tx throughput of the interfaces of --local_addrs over
+// its lifetime.
+class InterfaceReport {
+ public:
+  explicit InterfaceReport(const string& operation)
+  : operation_(operation), t0_(steady_clock::now()),
+    bytes0_(g_local_addr_ifaces.empty() ? decltype(bytes0_)() :
+                                          ReadNetDevBytes()) {}
+
+  ~InterfaceReport() {
+    if (g_local_addr_ifaces.empty()) {
+      return;
+    }
+    const double time_sec =
+      duration_cast<duration<double>>(steady_clock::now() - t0_).count();
+    const auto bytes = ReadNetDevBytes();
+    for (const string& iface : g_local_addr_ifaces) {
+      auto it0 = bytes0_.find(iface);
+      auto it = bytes.find(iface);
+      if (it0 == bytes0_.end() || it == bytes.end()) {
+        continue;
+      }
+      cout << operation_ << " interface " << iface << ": rx "
+           << ((it->second.first - it0->second.first) / 1048576.0 / time_sec)
+           << " MB/sec, tx "
+           << ((it->second.second - it0->second.second) / 1048576.0 /
+               time_sec) << " MB/sec" << endl;
+    }
+  }
+
+ private:
+  const string operation_;
+  const steady_clock::time_point t0_;
+  const map<string, pair<uint64_t, uint64_t>> bytes0_;
+};
+
+//-----------------------------------------------------------------------------
+// Presigned URLs over raw libcurl
+//-----------------------------------------------------------------------------
+
+// URLs per thread and object, generated before the stage with
+// --client=presigned.
+static vector<vector<string>> g_presigned_urls;
+
+// Generates the presigned URLs of all keys with one S3Client per thread and
+// reports the generation rate.
+static void PresignUrls(Aws::Http::HttpMethod method, const string& name) {
+  g_presigned_urls.assign(FLAGS_num_threads, vector<string>());
+  vector<thread *> threads;
+  const high_resolution_clock::time_point t0 = high_resolution_clock::now();
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    threads.push_back(new thread([ii, method] {
+      Aws::S3::S3Client s3_client(ClientConfig());
+      vector<string>& urls = g_presigned_urls[ii];
+      for (int jj = 0; jj < FLAGS_num_objects; ++jj) {
+        // Valid for the longest period SigV4 allows, 7 days.
+        const Aws::String url = s3_client.GeneratePresignedUrl(
+          ObjBucket(ii, jj), ObjKey(ii, jj), method, 7 * 24 * 3600);
+        urls.emplace_back(url.c_str(), url.size());
+      }
+    }));
+  }
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    threads[ii]->join();
+    delete threads[ii];
+  }
+  const double time_sec = duration_cast<duration<double>>(
+    high_resolution_clock::now() - t0).count();
+  const int num_urls = FLAGS_num_threads * FLAGS_num_objects;
+  cout << "PRESIGN " << name << ": " << num_urls << " URLs in " << time_sec
+       << " seconds, " << (1e6 * time_sec / num_urls) << " us/URL ("
+       << FLAGS_num_threads << " threads)" << endl << endl;
+}
+
+// Transfer state of one easy handle.
+struct RawTransfer {
+  CURL *easy = nullptr;
+  int obj_num = 0;
+  steady_clock::time_point submit_time;
+  // Upload read offset, or downloaded bytes.
+  int64_t offset = 0;
+};
+
+static size_t RawRead(char *buf, size_t size, size_t nmemb, void *arg) {
+  RawTransfer *xfer = static_cast<RawTransfer *>(arg);
+  const char *data = g_payload ? g_payload->data() : g_obj.data();
+  const size_t num = min<int64_t>(size * nmemb, ObjSize() - xfer->offset);
+  memcpy(buf, data + xfer->offset, num);
+  xfer->offset += num;
+  AddMovedBytes(num);
+  return num;
+}
+
+static size_t RawWrite(char *buf, size_t size, size_t nmemb, void *arg) {
+  // Count and drop the body, the object is not verified beyond its size.
+  static_cast<RawTransfer *>(arg)->offset += size * nmemb;
+  AddMovedBytes(size * nmemb);
+  return size * nmemb;
+}
+
+// Drives the presigned URLs of one thread through a curl multi handle with
+// FLAGS_num_outstanding_req transfers on a single event loop.
+static void RawTransferThread(const int thread_num, const bool upload) {
+  CURLM *multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    (long)FLAGS_num_connections);
+  curl_slist *headers = curl_slist_append(nullptr, "Expect:");
+
+  const vector<string>& urls = g_presigned_urls[thread_num];
+  const string local_addr = LocalAddr(thread_num);
+  const string interface = local_addr.empty() ? "" : "host!" + local_addr;
+  vector<RawTransfer> xfers(FLAGS_num_outstanding_req);
+  vector<RawTransfer *> idle;
+  for (RawTransfer& xfer : xfers) {
+    xfer.easy = curl_easy_init();
+    idle.push_back(&xfer);
+  }
+
+  int next_obj = 0, running = 0;
+  // The next transfer was charged against the rate limits and waits for
+  // release_time, while the others keep running.
+  bool reserved = false;
+  steady_clock::time_point release_time;
+  while ((next_obj < FLAGS_num_objects && !Stopping()) ||
+         idle.size() < xfers.size()) {
+    while (next_obj < FLAGS_num_objects && !Stopping() && !idle.empty()) {
+      if (!reserved) {
+        release_time = ReserveThrottle(ObjSize());
+        reserved = true;
+      }
+      if (steady_clock::now() < release_time) {
+        break;
+      }
+      reserved = false;
+      RawTransfer *xfer = idle.back();
+      idle.pop_back();
+      xfer->obj_num = next_obj++;
+      xfer->offset = 0;
+      xfer->submit_time = steady_clock::now();
+      CURL *easy = xfer->easy;
+      // Keeps the connection cache, which belongs to the multi handle.
+      curl_easy_reset(easy);
+      curl_easy_setopt(easy, CURLOPT_URL, urls[xfer->obj_num].c_str());
+      curl_easy_setopt(easy, CURLOPT_PRIVATE, xfer);
+      curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(easy, CURLOPT_TCP_NODELAY, 1L);
+      curl_easy_setopt(easy, CURLOPT_SOCKOPTFUNCTION, CurlTuneSocket);
+      if (!interface.empty()) {
+        curl_easy_setopt(easy, CURLOPT_INTERFACE, interface.c_str());
+      }
+      if (upload) {
+        curl_easy_setopt(easy, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(easy, CURLOPT_INFILESIZE_LARGE,
+                         (curl_off_t)ObjSize());
+        curl_easy_setopt(easy, CURLOPT_READFUNCTION, RawRead);
+        curl_easy_setopt(easy, CURLOPT_READDATA, xfer);
+      } else {
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, RawWrite);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, xfer);
+      }
+      curl_multi_add_handle(multi, easy);
+    }
+
+    curl_multi_perform(multi, &running);
+    int num_msgs;
+    while (CURLMsg *msg = curl_multi_info_read(multi, &num_msgs)) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      RawTransfer *xfer;
+      long code = 0;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &xfer);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+      if (msg->data.result != CURLE_OK || code != 200) {
+        cerr << "ERROR: " << urls[xfer->obj_num].substr(0,
+                urls[xfer->obj_num].find('?')) << ": "
+             << (msg->data.result != CURLE_OK ?
+                 curl_easy_strerror(msg->data.result) : "HTTP status")
+             << " " << code << endl;
+        exit(1);
+      }
+      if (!upload && xfer->offset != ObjSize()) {
+        cerr << "ERROR: invalid object size " << xfer->offset
+             << ", expected " << ObjSize() << " bytes" << endl;
+        exit(1);
+      }
+      curl_multi_remove_handle(multi, xfer->easy);
+      if (!upload) {
+        // Microseconds from the start of the transfer.
+        curl_off_t pretransfer = 0, starttransfer = 0, total = 0;
+        curl_easy_getinfo(xfer->easy, CURLINFO_PRETRANSFER_TIME_T,
+                          &pretransfer);
+        curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME_T,
+                          &starttransfer);
+        curl_easy_getinfo(xfer->easy, CURLINFO_TOTAL_TIME_T, &total);
+        RecordStream(starttransfer - pretransfer, total - starttransfer,
+                     xfer->offset);
+      }
+      RecordCompletion(ElapsedUs(xfer->submit_time), ObjSize());
+      idle.push_back(xfer);
+    }
+    if (running > 0 || reserved) {
+      curl_multi_poll(multi, nullptr, 0,
+                      reserved ? PollTimeoutMs(release_time, 1000) : 1000,
+                      nullptr);
+    }
+  }
+  if (reserved) {
+    RefundThrottle(ObjSize());
+  }
+
+  for (RawTransfer& xfer : xfers) {
+    curl_easy_cleanup(xfer.easy);
+  }
+  curl_slist_free_all(headers);
+  curl_multi_cleanup(multi);
+}
+
+//-----------------------------------------------------------------------------
+// Event-driven driver
+//-----------------------------------------------------------------------------
+
+// One request slot of EventLoopThread: a connection and the state machine of
+// the request currently running on it. Costs a few KB per slot, the payload
+// is sent from the shared buffer and the received body is only counted.
+struct EventReq {
+  enum State { kIdle, kThrottled, kConnecting, kSending, kReceiving };
+
+  int fd = -1;
+  State state = kIdle;
+  int obj_num = 0;
+  // Server of the request, and of the open connection. The presigned URLs
+  // of several buckets name different hosts.
+  const struct addrinfo *addr = nullptr;
+  const struct addrinfo *conn_addr = nullptr;
+  // Whether the connection served a previous request.
+  bool reused = false;
+  string header;
+  int64_t sent = 0;
+  int64_t received = 0;
+  unique_ptr<HttpResponseParser> parser;
+  // When a kThrottled request may be sent.
+  steady_clock::time_point release_time;
+  steady_clock::time_point submit_time;
+  // The request was sent, and the first body byte received.
+  steady_clock::time_point sent_time;
+  steady_clock::time_point first_byte;
+};
+
+// Splits a presigned http URL into host, port and request target.
+static bool ParseHttpUrl(const string& url,
+                         string *host,
+                         string *port,
+                         string *target) {
+  if (url.compare(0, 7, "http://") != 0) {
+    return false;
+  }
+  const size_t slash = url.find('/', 7);
+  const string authority = url.substr(7, slash - 7);
+  *target = slash == string::npos ? "/" : url.substr(slash);
+  const size_t colon = authority.rfind(':');
+  if (colon != string::npos && authority.find(']', colon) == string::npos) {
+    *host = authority.substr(0, colon);
+    *port = authority.substr(colon + 1);
+  } else {
+    *host = authority;
+    *port = "80";
+  }
+  return true;
+}
+
+// Runs FLAGS_num_outstanding_req concurrent requests of one thread as
+// callback driven state machines over non-blocking sockets and epoll, using
+// the presigned URLs of the thread. Every slot keeps its connection alive
+// across the requests to the same host.
+static void EventLoopThread(const int thread_num, const bool upload) {
+  const vector<string>& urls = g_presigned_urls[thread_num];
+  if (urls.empty()) {
+    return;
+  }
+  string host, port, target;
+  if (!ParseHttpUrl(urls[0], &host, &port, &target)) {
+    cerr << "ERROR: --client=event requires --scheme=http" << endl;
+    exit(1);
+  }
+  // Resolved once per host and port.
+  map<string, struct addrinfo *> addrs;
+  auto resolve = [&addrs](const string& host, const string& port) {
+    struct addrinfo *& addr = addrs[host + ":" + port];
+    if (!addr) {
+      struct addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addr)) {
+        cerr << "ERROR: failed to resolve " << host << endl;
+        exit(1);
+      }
+    }
+    return addr;
+  };
+
+  const int ep = epoll_create1(EPOLL_CLOEXEC);
+  vector<EventReq> reqs(FLAGS_num_outstanding_req);
+  const char *payload = g_payload ? g_payload->data() : g_obj.data();
+  // Shared by all slots, the bodies are not kept.
+  vector<char> recv_buf(64 * 1024);
+  int next_obj = 0, in_flight = 0;
+  // kThrottled slots, in no particular order.
+  vector<EventReq *> throttled;
+
+  auto fail = [&](const EventReq& req, const string& msg) {
+    cerr << "ERROR: " << urls[req.obj_num].substr(0,
+            urls[req.obj_num].find('?')) << ": " << msg << endl;
+    exit(1);
+  };
+
+  auto watch = [&](EventReq *req, uint32_t events, bool add) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = req;
+    epoll_ctl(ep, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, req->fd, &ev);
+  };
+
+  auto connect_slot = [&](EventReq *req) {
+    const struct addrinfo *addr = req->addr;
+    req->fd = socket(addr->ai_family,
+                     SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (req->fd < 0) {
+      fail(*req, string("socket: ") + strerror(errno));
+    }
+    const int one = 1;
+    setsockopt(req->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    TuneSocket(req->fd);
+    if (const int err =
+          BindLocalAddr(req->fd, addr->ai_family, LocalAddr(thread_num))) {
+      fail(*req, string("bind: ") + strerror(err));
+    }
+    if (connect(req->fd, addr->ai_addr, addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+      fail(*req, string("connect: ") + strerror(errno));
+    }
+    req->conn_addr = addr;
+    req->reused = false;
+    req->state = EventReq::kConnecting;
+    watch(req, EPOLLOUT, true);
+  };
+
+  auto close_slot = [&](EventReq *req) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, req->fd, nullptr);
+    close(req->fd);
+    req->fd = -1;
+  };
+
+  // Sends the request of the slot from the start, on its open connection or
+  // on a new one.
+  auto send_request = [&](EventReq *req) {
+    req->sent = req->received = 0;
+    req->parser.reset(new HttpResponseParser(
+      false, nullptr, [req](const char *data, size_t len) {
+        if (req->received == 0) {
+          req->first_byte = steady_clock::now();
+        }
+        req->received += len;
+        AddMovedBytes(len);
+        return true;
+      }));
+    if (req->fd < 0) {
+      connect_slot(req);
+    } else {
+      req->reused = true;
+      req->state = EventReq::kSending;
+      watch(req, EPOLLOUT, false);
+    }
+  };
+
+  auto start = [&](EventReq *req) {
+    if (next_obj >= FLAGS_num_objects || Stopping()) {
+      if (req->fd >= 0) {
+        close_slot(req);
+      }
+      req->state = EventReq::kIdle;
+      return;
+    }
+    req->obj_num = next_obj++;
+    if (!ParseHttpUrl(urls[req->obj_num], &host, &port, &target)) {
+      fail(*req, "not an http URL");
+    }
+    req->addr = resolve(host, port);
+    if (req->fd >= 0 && req->conn_addr != req->addr) {
+      close_slot(req);
+    }
+    req->header = string(upload ? "PUT " : "GET ") + target +
+                  " HTTP/1.1\r\nHost: " + host + "\r\n";
+    if (upload) {
+      req->header += "Content-Length: " + to_string(ObjSize()) + "\r\n";
+    }
+    req->header += "\r\n";
+    ++in_flight;
+    req->release_time = ReserveThrottle(ObjSize());
+    if (req->release_time > steady_clock::now()) {
+      // Waits in the loop below, without blocking the other slots. The
+      // idle connection is not watched until then.
+      if (req->fd >= 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, req->fd, nullptr);
+      }
+      req->state = EventReq::kThrottled;
+      throttled.push_back(req);
+      return;
+    }
+    req->submit_time = steady_clock::now();
+    send_request(req);
+  };
+
+  // Sends the throttled requests whose time came, or drops them when the
+  // program is stopping.
+  auto release = [&]() {
+    const steady_clock::time_point now = steady_clock::now();
+    for (size_t ii = 0; ii < throttled.size();) {
+      EventReq *req = throttled[ii];
+      if (req->release_time > now && !Stopping()) {
+        ++ii;
+        continue;
+      }
+      throttled[ii] = throttled.back();
+      throttled.pop_back();
+      if (Stopping()) {
+        RefundThrottle(ObjSize());
+        --in_flight;
+        if (req->fd >= 0) {
+          close(req->fd);
+          req->fd = -1;
+        }
+        req->state = EventReq::kIdle;
+        continue;
+      }
+      if (req->fd >= 0) {
+        watch(req, EPOLLIN, true);
+      }
+      req->submit_time = now;
+      send_request(req);
+    }
+  };
+
+  auto on_event = [&](EventReq *req) {
+    if (req->state == EventReq::kConnecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err) {
+        fail(*req, string("connect: ") + strerror(err));
+      }
+      req->state = EventReq::kSending;
+    }
+
+    if (req->state == EventReq::kSending) {
+      const int64_t total = req->header.size() + (upload ? ObjSize() : 0);
+      while (req->sent < total) {
+        struct iovec iov[2];
+        int num_iov = 0;
+        if (req->sent < (int64_t)req->header.size()) {
+          iov[num_iov].iov_base = &req->header[req->sent];
+          iov[num_iov++].iov_len = req->header.size() - req->sent;
+        }
+        const int64_t body_off =
+          max<int64_t>(req->sent - req->header.size(), 0);
+        if (upload && body_off < ObjSize()) {
+          iov[num_iov].iov_base = const_cast<char *>(payload) + body_off;
+          iov[num_iov++].iov_len = ObjSize() - body_off;
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num_iov;
+        const ssize_t ret = sendmsg(req->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0) {
+          if (errno == EAGAIN) {
+            return;
+          }
+          if (req->reused && req->sent == 0) {
+            // The server closed the idle connection, start over.
+            close_slot(req);
+            send_request(req);
+            return;
+          }
+          fail(*req, string("send: ") + strerror(errno));
+        }
+        // Counts the body part of the sent bytes.
+        const int64_t header_size = req->header.size();
+        AddMovedBytes(max<int64_t>(req->sent + ret - header_size, 0) -
+                      max<int64_t>(req->sent - header_size, 0));
+        req->sent += ret;
+      }
+      req->state = EventReq::kReceiving;
+      req->sent_time = steady_clock::now();
+      watch(req, EPOLLIN, false);
+      return;
+    }
+
+    // kReceiving.
+    while (!req->parser->done()) {
+      const ssize_t ret = recv(req->fd, recv_buf.data(), recv_buf.size(), 0);
+      // A kept-alive connection the server closed before the request
+      // arrived ends with an EOF or a reset before any response. The
+      // request is sent again on a new connection.
+      const bool closed_idle =
+        req->reused && req->received == 0 && !req->parser->status();
+      if (ret < 0) {
+        if (errno == EAGAIN) {
+          return;
+        }
+        if (closed_idle && (errno == ECONNRESET || errno == EPIPE)) {
+          close_slot(req);
+          send_request(req);
+          return;
+        }
+        fail(*req, string("recv: ") + strerror(errno));
+      }
+      if (ret == 0) {
+        if (closed_idle) {
+          close_slot(req);
+          send_request(req);
+          return;
+        }
+        if (!req->parser->Eof()) {
+          fail(*req, "connection closed");
+        }
+        break;
+      }
+      if (!req->parser->Parse(recv_buf.data(), ret)) {
+        fail(*req, "malformed response");
+      }
+    }
+
+    if (req->parser->status() != 200) {
+      fail(*req, "HTTP status " + to_string(req->parser->status()));
+    }
+    if (!upload && req->received != ObjSize()) {
+      fail(*req, "invalid object size " + to_string(req->received));
+    }
+    if (!upload && req->received > 0) {
+      RecordStream(
+        duration_cast<microseconds>(req->first_byte - req->sent_time).count(),
+        ElapsedUs(req->first_byte), req->received);
+    }
+    RecordCompletion(ElapsedUs(req->submit_time), ObjSize());
+    --in_flight;
+    if (!req->parser->keep_alive()) {
+      close_slot(req);
+    }
+    start(req);
+  };
+
+  for (EventReq& req : reqs) {
+    start(&req);
+  }
+  vector<struct epoll_event> events(1024);
+  while (in_flight > 0) {
+    int timeout_ms = 1000;
+    for (const EventReq *req : throttled) {
+      timeout_ms = PollTimeoutMs(req->release_time, timeout_ms);
+    }
+    const int num = epoll_wait(ep, events.data(), events.size(), timeout_ms);
+    for (int ii = 0; ii < num; ++ii) {
+      on_event(static_cast<EventReq *>(events[ii].data.ptr));
+    }
+    release();
+  }
+
+  for (EventReq& req : reqs) {
+    if (req.fd >= 0) {
+      close(req.fd);
+    }
+  }
+  close(ep);
+  for (const auto& host_addr : addrs) {
+    freeaddrinfo(host_addr.second);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// CRT S3 client and TransferManager
+//-----------------------------------------------------------------------------
+
+#ifdef S3_PERF_CRT
+
+static Aws::S3Crt::ClientConfiguration CrtClientConfig() {
+  Aws::S3Crt::ClientConfiguration crtConfig;
+  static_cast<Aws::Client::ClientConfiguration&>(crtConfig) = ClientConfig();
+  // The CRT client sizes its connection pool from the throughput target
+  // instead of maxConnections.
+  crtConfig.throughputTargetGbps = FLAGS_crt_target_gbps;
+  crtConfig.partSize = (uint64_t)FLAGS_crt_part_size_mb << 20;
+  return crtConfig;
+}
+
+static void CrtUploadThread(const int thread_num) {
+  Aws::S3Crt::S3CrtClient s3_client(CrtClientConfig());
+  Ctx ctx(thread_num);
+
+  for (int ii = 0; ii < FLAGS_num_objects && !Stopping(); ++ii) {
+    Aws::S3Crt::Model::PutObjectRequest object_request;
+    object_request.SetBucket(ObjBucket(thread_num, ii));
+    object_request.SetKey(ObjKey(thread_num, ii));
+    object_request.SetBody(MakePayloadStream());
+
+    if (!AcquireSubmission(&ctx)) {
+      break;
+    }
+    s3_client.PutObjectAsync(
+      object_request,
+      [](const Aws::S3Crt::S3CrtClient *client,
+         const Aws::S3Crt::Model::PutObjectRequest& request,
+         const Aws::S3Crt::Model::PutObjectOutcome& outcome,
+         const shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+        if (!outcome.IsSuccess()) {
+          ExitOnError(outcome.GetError());
+        }
+        CompleteRequest(static_cast<const ReqCtx&>(*context), ObjSize());
+      },
+      make_shared<ReqCtx>(&ctx));
+  }
+
+  ctx.WaitAll();
+}
+
+static void CrtDownloadThread(const int thread_num) {
+  Aws::S3Crt::S3CrtClient s3_client(CrtClientConfig());
+  Ctx ctx(thread_num);
+
+  for (int ii = 0; ii < FLAGS_num_objects && !Stopping(); ++ii) {
+    Aws::S3Crt::Model::GetObjectRequest object_request;
+    object_request.SetBucket(ObjBucket(thread_num, ii));
+    object_request.SetKey(ObjKey(thread_num, ii));
+    if (!g_recv_pools.empty()) {
+      RecvBufferPool *pool = g_recv_pools[thread_num].get();
+      object_request.SetResponseStreamFactory([pool] {
+        return pool->Acquire();
+      });
+    }
+
+    if (!AcquireSubmission(&ctx)) {
+      break;
+    }
+    // The outcome is passed by value or by reference depending on the SDK
+    // version.
+    s3_client.GetObjectAsync(
+      object_request,
+      [](const Aws::S3Crt::S3CrtClient *client,
+         const Aws::S3Crt::Model::GetObjectRequest& request,
+         const auto& outcome,
+         const shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+        if (!outcome.IsSuccess()) {
+          ExitOnError(outcome.GetError());
+        }
+        if (outcome.GetResult().GetContentLength() != ObjSize()) {
+          cerr << "ERROR: invalid object size "
+               << outcome.GetResult().GetContentLength()
+               << ", expected " << ObjSize() << " bytes" << endl;
+          exit(1);
+        }
+        CompleteRequest(static_cast<const ReqCtx&>(*context), ObjSize());
+      },
+      make_shared<ReqCtx>(&ctx));
+  }
+
+  ctx.WaitAll();
+}
+
+#endif // S3_PERF_CRT
+
+#ifdef S3_PERF_TRANSFER
+
+// Runs the uploads or downloads of one thread through a TransferManager on
+// top of an S3Client configured like the one of UploadThread/DownloadThread.
+static void TransferThread(const int thread_num, const bool upload) {
+  Aws::Utils::Threading::PooledThreadExecutor executor(FLAGS_num_connections);
+  Aws::Transfer::TransferManagerConfiguration tm_config(&executor);
+  t_client_local_addr = LocalAddr(thread_num);
+  tm_config.s3Client =
+    Aws::MakeShared<Aws::S3::S3Client>("s3_perf", ClientConfig());
+  tm_config.transferStatusUpdatedCallback =
+    [](const Aws::Transfer::TransferManager *tm,
+       const shared_ptr<const Aws::Transfer::TransferHandle>& handle) {
+      switch (handle->GetStatus()) {
+        case Aws::Transfer::TransferStatus::COMPLETED:
+          CompleteRequest(static_cast<const ReqCtx&>(*handle->GetContext()),
+                          handle->GetBytesTransferred());
+          break;
+        case Aws::Transfer::TransferStatus::FAILED:
+        case Aws::Transfer::TransferStatus::CANCELED:
+        case Aws::Transfer::TransferStatus::ABORTED:
+          ExitOnError(handle->GetLastError());
+          break;
+        default:
+          break;
+      }
+    };
+  shared_ptr<Aws::Transfer::TransferManager> tm =
+    Aws::Transfer::TransferManager::Create(tm_config);
+
+  Ctx ctx(thread_num);
+
+  for (int ii = 0; ii < FLAGS_num_objects && !Stopping(); ++ii) {
+    const Aws::String& s3_bucket_name = ObjBucket(thread_num, ii);
+    const Aws::String key = ObjKey(thread_num, ii);
+    if (!AcquireSubmission(&ctx)) {
+      break;
+    }
+    if (upload) {
+      tm->UploadFile(MakePayloadStream(), s3_bucket_name, key,
+                     "binary/octet-stream",
+                     Aws::Map<Aws::String, Aws::String>(),
+                     make_shared<ReqCtx>(&ctx));
+    } else {
+      Aws::Transfer::CreateDownloadStreamCallback stream_factory = [] {
+        return Aws::New<Aws::StringStream>("s3_perf");
+      };
+      if (!g_recv_pools.empty()) {
+        RecvBufferPool *pool = g_recv_pools[thread_num].get();
+        stream_factory = [pool] { return pool->Acquire(); };
+      }
+      tm->DownloadFile(s3_bucket_name, key, stream_factory,
+                       Aws::Transfer::DownloadConfiguration(), "",
+                       make_shared<ReqCtx>(&ctx));
+    }
+  }
+
+  ctx.WaitAll();
+}
+
+#endif // S3_PERF_TRANSFER
+
+//-----------------------------------------------------------------------------
+// Read-after-write
+//-----------------------------------------------------------------------------
+
+// Result of a read of a just written object: the new version, an older
+// version, or no object at all.
+enum ReadState { kReadFresh, kReadStale, kReadMissing, kNumReadStates };
+
+enum VisibilityProbe { kProbeGet, kProbeList, kNumProbes };
+static const char *const kProbeNames[kNumProbes] = {"GET", "LIST"};
+
+// Reads of the objects written by the PUTs until they are visible.
+struct VisibilityStats {
+  // Time from the PUT completion until the object was read fresh.
+  LatencyHistogram time_to_visible;
+  // State of the first read after the PUT.
+  atomic<int64_t> first_read[kNumReadStates] = {};
+  atomic<int64_t> reads{0};
+  // Objects not read fresh within --read_after_write_timeout_ms.
+  atomic<int64_t> timeouts{0};
+};
+static VisibilityStats g_visibility[kNumProbes];
+
+// Reads the first byte of the object, which is enough to compare its ETag.
+static ReadState ProbeGet(const Aws::S3::S3Client& client,
+                          const Aws::String& bucket, const Aws::String& key,
+                          const Aws::String& etag) {
+  Aws::S3::Model::GetObjectRequest request;
+  request.SetBucket(bucket);
+  request.SetKey(key);
+  if (ObjSize() > 0) {
+    request.SetRange("bytes=0-0");
+  }
+  const Aws::S3::Model::GetObjectOutcome outcome = client.GetObject(request);
+  if (!outcome.IsSuccess()) {
+    if (outcome.GetError().GetResponseCode() !=
+        Aws::Http::HttpResponseCode::NOT_FOUND) {
+      ExitOnError(outcome.GetError());
+    }
+    return kReadMissing;
+  }
+  return outcome.GetResult().GetETag() == etag ? kReadFresh : kReadStale;
+}
+
+static ReadState ProbeList(const Aws::S3::S3Client& client,
+                           const Aws::String& bucket, const Aws::String& key,
+                           const Aws::String& etag) {
+  Aws::S3::Model::ListObjectsV2Request request;
+  request.SetBucket(bucket);
+  request.SetPrefix(key);
+  request.SetMaxKeys(1);
+  const Aws::S3::Model::ListObjectsV2Outcome outcome =
+    client.ListObjectsV2(request);
+  if (!outcome.IsSuccess()) {
+    ExitOnError(outcome.GetError());
+  }
+  for (const Aws::S3::Model::Object& object :
+       outcome.GetResult().GetContents()) {
+    if (object.GetKey() == key) {
+      return object.GetETag() == etag ? kReadFresh : kReadStale;
+    }
+  }
+  return kReadMissing;
+}
+
+// Reads the object written by a PUT with blocking calls until the GET, and
+// the LIST with --read_after_write_list, return its ETag. Called right after
+// the PUT completion on the thread that handled it.
+static void ProbeReadAfterWrite(const Aws::S3::S3Client& client,
+                                const Aws::String& bucket,
+                                const Aws::String& key,
+                                const Aws::String& etag) {
+  const steady_clock::time_point t0 = steady_clock::now();
+  const steady_clock::time_point deadline =
+    t0 + milliseconds(FLAGS_read_after_write_timeout_ms);
+  for (int probe = 0; probe < kNumProbes; ++probe) {
+    if (probe == kProbeList && !FLAGS_read_after_write_list) {
+      break;
+    }
+    VisibilityStats& stats = g_visibility[probe];
+    for (int attempt = 0; ; ++attempt) {
+      const ReadState state = probe == kProbeGet ?
+        ProbeGet(client, bucket, key, etag) :
+        ProbeList(client, bucket, key, etag);
+      ++stats.reads;
+      if (attempt == 0) {
+        ++stats.first_read[state];
+      }
+      if (state == kReadFresh) {
+        stats.time_to_visible.Add(ElapsedUs(t0));
+        break;
+      }
+      if (steady_clock::now() >= deadline) {
+        ++stats.timeouts;
+        break;
+      }
+      this_thread::sleep_for(milliseconds(FLAGS_read_after_write_retry_ms));
+    }
+  }
+}
+
+// Prints the visibility of the objects written while in scope.
+class ReadAfterWriteReport {
+ public:
+  explicit ReadAfterWriteReport(const string& operation)
+  : operation_(operation) {
+    for (int ii = 0; ii < kNumProbes; ++ii) {
+      const VisibilityStats& stats = g_visibility[ii];
+      time_to_visible0_[ii] = stats.time_to_visible.GetSnapshot();
+      for (int jj = 0; jj < kNumReadStates; ++jj) {
+        first_read0_[ii][jj] = stats.first_read[jj];
+      }
+      reads0_[ii] = stats.reads;
+      timeouts0_[ii] = stats.timeouts;
+    }
+  }
+
+  ~ReadAfterWriteReport() {
+    for (int ii = 0; ii < kNumProbes; ++ii) {
+      const VisibilityStats& stats = g_visibility[ii];
+      int64_t first_read[kNumReadStates];
+      int64_t num_objects = 0;
+      for (int jj = 0; jj < kNumReadStates; ++jj) {
+        first_read[jj] = stats.first_read[jj] - first_read0_[ii][jj];
+        num_objects += first_read[jj];
+      }
+      if (num_objects == 0) {
+        continue;
+      }
+      cout << operation_ << " read-after-write " << kProbeNames[ii] << ": "
+           << num_objects << " objects, "
+           << (double)(stats.reads - reads0_[ii]) / num_objects
+           << " reads/obj, first read fresh "
+           << (100.0 * first_read[kReadFresh] / num_objects) << "%, stale "
+           << (100.0 * first_read[kReadStale] / num_objects) << "%, missing "
+           << (100.0 * first_read[kReadMissing] / num_objects) << "%, "
+           << (stats.timeouts - timeouts0_[ii]) << " timeouts" << endl
+           << operation_ << " time to visible " << kProbeNames[ii] << ": "
+           << (stats.time_to_visible.GetSnapshot() -
+               time_to_visible0_[ii]).Format() << endl;
+    }
+  }
+
+ private:
+  const string operation_;
+  LatencyHistogram::Snapshot time_to_visible0_[kNumProbes];
+  int64_t first_read0_[kNumProbes][kNumReadStates];
+  int64_t reads0_[kNumProbes];
+  int64_t timeouts0_[kNumProbes];
+};
+
+//-----------------------------------------------------------------------------
+// Upload
+//-----------------------------------------------------------------------------
+
+static void ObjUploadDone(
+  const Aws::S3::S3Client *client,
+  const Aws::S3::Model::PutObjectRequest& request,
+  const Aws::S3::Model::PutObjectOutcome& outcome,
+  const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+
+  AllocStageScope alloc_stage(kAllocStageCallback);
+  const ReqCtx& req_ctx = static_cast<const ReqCtx&>(*context);
+  if (!outcome.IsSuccess()) {
+    if (req_ctx.cancelled()) {
+      DropCancelledRequest(req_ctx.endpoint());
+      req_ctx.ctx()->ReleaseSlot();
+      return;
+    }
+    ExitOnError(outcome.GetError());
+  }
+
+  if (FLAGS_read_after_write) {
+    // The reads hold the slot of the PUT, so they count against
+    // num_outstanding_req.
+    RecordRequest(req_ctx, ObjSize());
+    ProbeReadAfterWrite(*client, request.GetBucket(), request.GetKey(),
+                        outcome.GetResult().GetETag());
+    req_ctx.ctx()->ReleaseSlot();
+    return;
+  }
+  CompleteRequest(req_ctx, ObjSize());
+}
+
+// Builds the PUT of an object, and returns its g_in_flight entry in
+// 'in_flight' unless it is null.
+static Aws::S3::Model::PutObjectRequest PutRequest(
+  const int thread_num,
+  const int obj_num,
+  shared_ptr<InFlightReq> *in_flight = nullptr) {
+
+  Aws::S3::Model::PutObjectRequest object_request;
+  shared_ptr<Aws::IOStream> input_data = MakePayloadStream();
+
+  const int partition = ObjPartition(thread_num, obj_num);
+  object_request.SetBucket(PartitionBucket(partition));
+  object_request.SetKey(ObjKey(thread_num, obj_num));
+
+  object_request.SetBody(input_data);
+  object_request.SetDataSentEventHandler(
+    [](const Aws::Http::HttpRequest *, long long bytes) {
+      AddMovedBytes(bytes);
+    });
+  shared_ptr<InFlightReq> req =
+    SetRequestHandlers(&object_request, partition, "PUT");
+  if (in_flight) {
+    *in_flight = move(req);
+  }
+  return object_request;
+}
+
+// Runs op(obj_num) for all the objects of a thread from
+// FLAGS_num_outstanding_req worker threads making blocking calls.
+static void RunSyncWorkers(const function<void(int)>& op) {
+  atomic<int> next_obj{0};
+  vector<thread> workers;
+  for (int ii = 0; ii < FLAGS_num_outstanding_req; ++ii) {
+    workers.emplace_back([&op, &next_obj] {
+      for (int obj_num = next_obj++;
+           obj_num < FLAGS_num_objects && !Stopping();
+           obj_num = next_obj++) {
+        op(obj_num);
+      }
+    });
+  }
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+static void UploadThread(const int thread_num) {
+  const ClientGroup& clients = GetS3Client(thread_num);
+
+  if (FLAGS_api == "sync") {
+    RunSyncWorkers([&clients, thread_num](int obj_num) {
+      AllocStageScope alloc_stage(kAllocStageRequest);
+      Throttle(ObjSize());
+      if (Stopping()) {
+        RefundThrottle(ObjSize());
+        return;
+      }
+      shared_ptr<InFlightReq> in_flight;
+      Aws::S3::Model::PutObjectRequest object_request =
+        PutRequest(thread_num, obj_num, &in_flight);
+      const int endpoint = PickEndpoint(object_request.GetKey());
+      BeginEndpointRequest(endpoint);
+      const steady_clock::time_point t0 = steady_clock::now();
+      const Aws::S3::Model::PutObjectOutcome outcome =
+        clients[endpoint]->PutObject(object_request);
+      if (!outcome.IsSuccess()) {
+        if (in_flight->cancelled) {
+          DropCancelledRequest(endpoint);
+          return;
+        }
+        ExitOnError(outcome.GetError());
+      }
+      const int64_t latency_us = ElapsedUs(t0);
+      RecordCompletion(latency_us, ObjSize());
+      EndEndpointRequest(endpoint, latency_us);
+      if (FLAGS_read_after_write) {
+        ProbeReadAfterWrite(*clients[endpoint], object_request.GetBucket(),
+                            object_request.GetKey(),
+                            outcome.GetResult().GetETag());
+      }
+    });
+    return;
+  }
+
+  Ctx ctx(thread_num);
+
+  // Upload objects.
+  for (int ii = 0; ii < FLAGS_num_objects && !Stopping(); ++ii) {
+    AllocStageScope alloc_stage(kAllocStageRequest);
+    if (!AcquireSubmission(&ctx)) {
+      break;
+    }
+
+    // Built once it can be sent, so its in-flight age starts here.
+    shared_ptr<InFlightReq> in_flight;
+    Aws::S3::Model::PutObjectRequest object_request =
+      PutRequest(thread_num, ii, &in_flight);
+    const int endpoint = PickEndpoint(object_request.GetKey());
+    BeginEndpointRequest(endpoint);
+
+    // Put the object.
+    clients[endpoint]->PutObjectAsync(
+      object_request, ObjUploadDone,
+      make_shared<ReqCtx>(&ctx, endpoint, move(in_flight)));
+  }
+
+  ctx.WaitAll();
+}
+
+static void Upload(const int iteration) {
+  SetUpS3Clients();
+  vector<thread *> threads;
+  const string operation = string("  [") + to_string(iteration) + "] UPLOAD";
+  ReportDuration report(operation,
+                        FLAGS_num_threads,
+                        FLAGS_num_objects,
+                        FLAGS_obj_size_kb);
+  IntervalReporter interval_report(operation);
+  ConnectionSampler connection_sampler(operation);
+  InterfaceReport interface_report(operation);
+  ReadAfterWriteReport read_after_write_report(operation);
+  StallWatchdog stall_watchdog(operation);
+
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    if (FLAGS_client == "presigned") {
+      threads.push_back(new thread(RawTransferThread, ii, true));
+    } else if (FLAGS_client == "event") {
+      threads.push_back(new thread(EventLoopThread, ii, true));
+#ifdef S3_PERF_CRT
+    } else if (FLAGS_client == "crt") {
+      threads.push_back(new thread(CrtUploadThread, ii));
+#endif
+#ifdef S3_PERF_TRANSFER
+    } else if (FLAGS_client == "transfer") {
+      threads.push_back(new thread(TransferThread, ii, true));
+#endif
+    } else {
+      threads.push_back(new thread(UploadThread, ii));
+    }
+  }
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    threads[ii]->join();
+    delete threads[ii];
+  }
+  TearDownS3Clients();
+  if (UsesCtx()) {
+    PrintSlotUtilization(operation);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Download
+//-----------------------------------------------------------------------------
+
+// Exits unless the GET succeeded and returned a whole object.
+static void CheckGetOutcome(const Aws::S3::Model::GetObjectOutcome& outcome) {
+  if (!outcome.IsSuccess()) {
+    if (outcome.GetError().GetResponseCode() ==
+        Aws::Http::HttpResponseCode::NOT_FOUND) {
+      cerr << "ERROR: missing object, upload it with --stage=upload and the "
+           << "same flags, or with --stage=populate --manifest" << endl;
+    }
+    ExitOnError(outcome.GetError());
+  }
+
+  if (outcome.GetResult().GetContentLength() != ObjSize()) {
+    cerr << "ERROR: invalid object size "
+         << outcome.GetResult().GetContentLength()
+         << ", expected " << ObjSize() << " bytes" << endl;
+    exit(1);
+  }
+}
+
+static void ObjDownloadDone(
+  const Aws::S3::S3Client *client,
+  const Aws::S3::Model::GetObjectRequest& request,
+  const Aws::S3::Model::GetObjectOutcome& outcome,
+  const std::shared_ptr<const Aws::Client::AsyncCallerContext>& context) {
+
+  AllocStageScope alloc_stage(kAllocStageCallback);
+  const ReqCtx& req_ctx = static_cast<const ReqCtx&>(*context);
+  if (!outcome.IsSuccess() && req_ctx.cancelled()) {
+    DropCancelledRequest(req_ctx.endpoint());
+    req_ctx.ctx()->ReleaseSlot();
+    return;
+  }
+  CheckGetOutcome(outcome);
+  CompleteRequest(req_ctx, outcome.GetResult().GetContentLength());
+}
+
+// Builds the GET of an object, and returns its g_in_flight entry in
+// 'in_flight' unless it is null.
+static Aws::S3::Model::GetObjectRequest GetRequest(
+  const int thread_num,
+  const int obj_num,
+  shared_ptr<InFlightReq> *in_flight = nullptr) {
+
+  Aws::S3::Model::GetObjectRequest object_request;
+  const int partition = ObjPartition(thread_num, obj_num);
+  object_request.SetBucket(PartitionBucket(partition));
+  object_request.SetKey(ObjKey(thread_num, obj_num));
+  if (!g_recv_pools.empty()) {
+    RecvBufferPool *pool = g_recv_pools[thread_num].get();
+    object_request.SetResponseStreamFactory([pool] {
+      return pool->Acquire();
+    });
+  }
+  object_request.SetDataReceivedEventHandler(
+    [](const Aws::Http::HttpRequest *, Aws::Http::HttpResponse *,
+       long long bytes) {
+      OnBodyReceived(bytes);
+    });
+  shared_ptr<InFlightReq> req =
+    SetRequestHandlers(&object_request, partition, "GET");
+  if (in_flight) {
+    *in_flight = move(req);
+  }
+  return object_request;
+}
+
+static void DownloadThread(const int thread_num) {
+  const ClientGroup& clients = GetS3Client(thread_num);
+
+  if (FLAGS_api == "sync") {
+    RunSyncWorkers([&clients, thread_num](int obj_num) {
+      AllocStageScope alloc_stage(kAllocStageRequest);
+      Throttle(ObjSize());
+      if (Stopping()) {
+        RefundThrottle(ObjSize());
+        return;
+      }
+      shared_ptr<InFlightReq> in_flight;
+      Aws::S3::Model::GetObjectRequest object_request =
+        GetRequest(thread_num, obj_num, &in_flight);
+      const int endpoint = PickEndpoint(object_request.GetKey());
+      BeginEndpointRequest(endpoint);
+      const steady_clock::time_point t0 = steady_clock::now();
+      const Aws::S3::Model::GetObjectOutcome outcome =
+        clients[endpoint]->GetObject(object_request);
+      if (!outcome.IsSuccess() && in_flight->cancelled) {
+        DropCancelledRequest(endpoint);
+        return;
+      }
+      CheckGetOutcome(outcome);
+      const int64_t latency_us = ElapsedUs(t0);
+      RecordCompletion(latency_us, ObjSize());
+      EndEndpointRequest(endpoint, latency_us);
+    });
+    return;
+  }
+
+  Ctx ctx(thread_num);
+
+  // Upload objects.
+  for (int ii = 0; ii < FLAGS_num_objects && !Stopping(); ++ii) {
+    AllocStageScope alloc_stage(kAllocStageRequest);
+    if (!AcquireSubmission(&ctx)) {
+      break;
+    }
+
+    // Built once it can be sent, so its in-flight age starts here.
+    shared_ptr<InFlightReq> in_flight;
+    Aws::S3::Model::GetObjectRequest object_request =
+      GetRequest(thread_num, ii, &in_flight);
+    const int endpoint = PickEndpoint(object_request.GetKey());
+    BeginEndpointRequest(endpoint);
+
+    // Get the object.
+    clients[endpoint]->GetObjectAsync(
+      object_request, ObjDownloadDone,
+      make_shared<ReqCtx>(&ctx, endpoint, move(in_flight)));
+  }
+
+  ctx.WaitAll();
+}
+
+static void Download(const int iteration) {
+  SetUpS3Clients();
+  vector<thread *> threads;
+  const string operation = string("  [") + to_string(iteration) + "] DOWNLOAD";
+  ReportDuration report(operation,
+                        FLAGS_num_threads,
+                        FLAGS_num_objects,
+                        FLAGS_obj_size_kb);
+  IntervalReporter interval_report(operation);
+  ConnectionSampler connection_sampler(operation);
+  InterfaceReport interface_report(operation);
+  StallWatchdog stall_watchdog(operation);
+
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    if (FLAGS_client == "presigned") {
+      threads.push_back(new thread(RawTransferThread, ii, false));
+    } else if (FLAGS_client == "event") {
+      threads.push_back(new thread(EventLoopThread, ii, false));
+#ifdef S3_PERF_CRT
+    } else if (FLAGS_client == "crt") {
+      threads.push_back(new thread(CrtDownloadThread, ii));
+#endif
+#ifdef S3_PERF_TRANSFER
+    } else if (FLAGS_client == "transfer") {
+      threads.push_back(new thread(TransferThread, ii, false));
+#endif
+    } else {
+      threads.push_back(new thread(DownloadThread, ii));
+    }
+  }
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    threads[ii]->join();
+    delete threads[ii];
+  }
+  TearDownS3Clients();
+  if (UsesCtx()) {
+    PrintSlotUtilization(operation);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Dataset manifest
+//-----------------------------------------------------------------------------
+
+// Object metadata of the populated objects, which identifies their content.
+static const char kSeedMetadata[] = "s3perf-seed";
+static const char kChecksumMetadata[] = "s3perf-checksum";
+
+static string ToHex(uint64_t value) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)value);
+  return hex;
+}
+
+// Fills 'data' with the splitmix64 sequence of 'seed' and returns the FNV-1a
+// checksum of its words.
+static uint64_t FillObject(char *data, int64_t size, uint64_t seed) {
+  uint64_t checksum = 14695981039346656037ull;
+  for (int64_t ii = 0; ii < size; ii += 8) {
+    seed += 0x9e3779b97f4a7c15ull;
+    uint64_t word = seed;
+    word = (word ^ (word >> 30)) * 0xbf58476d1ce4e5b9ull;
+    word = (word ^ (word >> 27)) * 0x94d049bb133111ebull;
+    word ^= word >> 31;
+    memcpy(data + ii, &word, min<int64_t>(sizeof(word), size - ii));
+    checksum = (checksum ^ word) * 1099511628211ull;
+  }
+  return checksum;
+}
+
+// Writes the manifest through a temporary file, so an interrupted run
+// leaves the previous one intact. The key is the rest of an object line, so
+// it may contain spaces.
+static void WriteManifest() {
+  const string tmp_path = FLAGS_manifest + ".tmp";
+  {
+    ofstream out(tmp_path);
+    out << "s3_perf manifest 1" << endl;
+    for (const Aws::String& bucket : g_buckets) {
+      out << "bucket " << bucket << endl;
+    }
+    for (const Aws::String& prefix : g_key_prefixes) {
+      out << "prefix " << prefix << endl;
+    }
+    for (const ManifestEntry& entry : g_manifest) {
+      out << "object " << entry.partition << " " << entry.size << " "
+          << ToHex(entry.seed) << " " << ToHex(entry.checksum) << " "
+          << entry.key << endl;
+    }
+    if (!out) {
+      cerr << "ERROR: cannot write " << tmp_path << endl;
+      exit(1);
+    }
+  }
+  if (rename(tmp_path.c_str(), FLAGS_manifest.c_str()) != 0) {
+    cerr << "ERROR: rename " << tmp_path << ": " << strerror(errno) << endl;
+    exit(1);
+  }
+}
+
+// Replaces the buckets, key prefixes and objects of the flags with the ones
+// of the manifest.
+static void LoadManifest(istream& in) {
+  string line;
+  if (!getline(in, line) || line != "s3_perf manifest 1") {
+    cerr << "ERROR: " << FLAGS_manifest << " is not a manifest" << endl;
+    exit(1);
+  }
+  g_buckets.clear();
+  g_key_prefixes.clear();
+  for (int line_num = 2; getline(in, line); ++line_num) {
+    const size_t space = line.find(' ');
+    const string type = line.substr(0, space);
+    const string value = space == string::npos ? "" : line.substr(space + 1);
+    istringstream fields(value);
+    ManifestEntry entry;
+    string key;
+    if (type == "bucket") {
+      g_buckets.emplace_back(value.c_str());
+    } else if (type == "prefix") {
+      g_key_prefixes.emplace_back(value.c_str());
+    } else if (type == "object" &&
+               fields >> entry.partition >> entry.size >> hex >> entry.seed
+                 >> entry.checksum && fields.get() == ' ' &&
+               getline(fields, key) && !key.empty() &&
+               entry.partition >= 0 &&
+               entry.partition <
+                 (int)(g_buckets.size() * g_key_prefixes.size())) {
+      entry.key = key.c_str();
+      g_manifest.push_back(entry);
+    } else {
+      cerr << "ERROR: " << FLAGS_manifest << ":" << line_num
+           << ": invalid line" << endl;
+      exit(1);
+    }
+  }
+  if (g_manifest.empty()) {
+    cerr << "ERROR: " << FLAGS_manifest << " has no objects" << endl;
+    exit(1);
+  }
+  // The stages transfer objects of a single size.
+  for (const ManifestEntry& entry : g_manifest) {
+    if (entry.size != g_manifest[0].size || entry.size % 1024 != 0) {
+      cerr << "ERROR: the objects of " << FLAGS_manifest << " must have "
+           << "the same size in KB" << endl;
+      exit(1);
+    }
+  }
+  FLAGS_obj_size_kb = g_manifest[0].size / 1024;
+}
+
+// Creates the manifest of the objects named by the flags, with a random
+// content seed per object.
+static void CreateManifest() {
+  mt19937_64 gen(random_device{}());
+  vector<ManifestEntry> entries;
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    for (int jj = 0; jj < FLAGS_num_objects; ++jj) {
+      entries.push_back(ManifestEntry{
+        ObjPartition(ii, jj), ObjSize(), gen(), 0, ObjKey(ii, jj)});
+    }
+  }
+  g_manifest.swap(entries);
+  WriteManifest();
+}
+
+static void InitManifest() {
+  ifstream in(FLAGS_manifest);
+  if (in) {
+    LoadManifest(in);
+    cout << "Manifest: " << g_manifest.size() << " objects of "
+         << FLAGS_obj_size_kb << " KB from " << FLAGS_manifest << endl;
+    return;
+  }
+  if (FLAGS_stage != "populate") {
+    cerr << "ERROR: cannot open " << FLAGS_manifest << ", create it with "
+         << "--stage=populate" << endl;
+    exit(1);
+  }
+  CreateManifest();
+  cout << "Manifest: " << g_manifest.size() << " objects created in "
+       << FLAGS_manifest << endl;
+}
+
+// Uploads the objects of the manifest that are missing, or have a different
+// size or seed, from num_threads threads. The manifest is written with the
+// checksums of the objects afterwards.
+static void Populate() {
+  const steady_clock::time_point t0 = steady_clock::now();
+  atomic<int64_t> next_obj{0}, num_present{0}, num_uploaded{0};
+  vector<thread> threads;
+  for (int ii = 0; ii < FLAGS_num_threads; ++ii) {
+    threads.emplace_back([&, ii] {
+      const ClientGroup clients = MakeClientGroup(LocalAddr(ii));
+      vector<char> data;
+      for (int64_t idx = next_obj++;
+           idx < (int64_t)g_manifest.size() && !Stopping();
+           idx = next_obj++) {
+        ManifestEntry& entry = g_manifest[idx];
+        const int endpoint = PickEndpoint(entry.key);
+        const string seed = ToHex(entry.seed);
+
+        Aws::S3::Model::HeadObjectRequest head_request;
+        head_request.SetBucket(PartitionBucket(entry.partition));
+        head_request.SetKey(entry.key);
+        const Aws::S3::Model::HeadObjectOutcome head_outcome =
+          clients[endpoint]->HeadObject(head_request);
+        if (head_outcome.IsSuccess()) {
+          const Aws::Map<Aws::String, Aws::String>& metadata =
+            head_outcome.GetResult().GetMetadata();
+          const auto seed_it = metadata.find(kSeedMetadata);
+          const auto checksum_it = metadata.find(kChecksumMetadata);
+          if (head_outcome.GetResult().GetContentLength() == entry.size &&
+              seed_it != metadata.end() && seed_it->second == seed.c_str() &&
+              checksum_it != metadata.end()) {
+            entry.checksum = strtoull(checksum_it->second.c_str(), nullptr,
+                                      16);
+            ++num_present;
+            continue;
+          }
+        } else {
+          // S3 answers 403 instead of 404 for a missing key without
+          // s3:ListBucket. The PUT fails too if access is really denied.
+          const Aws::Http::HttpResponseCode code =
+            head_outcome.GetError().GetResponseCode();
+          if (code != Aws::Http::HttpResponseCode::NOT_FOUND &&
+              code != Aws::Http::HttpResponseCode::FORBIDDEN) {
+            ExitOnError(head_outcome.GetError());
+          }
+        }
+
+        data.resize(entry.size);
+        entry.checksum = FillObject(data.data(), entry.size, entry.seed);
+        Aws::S3::Model::PutObjectRequest put_request;
+        put_request.SetBucket(PartitionBucket(entry.partition));
+        put_request.SetKey(entry.key);
+        put_request.AddMetadata(kSeedMetadata, seed.c_str());
+        put_request.AddMetadata(kChecksumMetadata,
+                                ToHex(entry.checksum).c_str());
+        put_request.SetBody(
+          Aws::MakeShared<MemStream>("s3_perf", data.data(), data.size()));
+        const Aws::S3::Model::PutObjectOutcome put_outcome =
+          clients[endpoint]->PutObject(put_request);
+        if (!put_outcome.IsSuccess()) {
+          ExitOnError(put_outcome.GetError());
+        }
+        ++num_uploaded;
+      }
+    });
+  }
+  for (thread& th : threads) {
+    th.join();
+  }
+  if (Stopping()) {
+    // The checksums of the objects not checked yet are unknown.
+    cout << "POPULATE interrupted: " << num_present << " objects present, "
+         << num_uploaded << " uploaded, manifest not written" << endl;
+    return;
+  }
+  WriteManifest();
+  cout << "POPULATE: " << num_present << " objects present, "
+       << num_uploaded << " uploaded ("
+       << (num_uploaded * ObjSize() / 1048576.0) << " MB) in "
+       << duration_cast<duration<double>>(steady_clock::now() - t0).count()
+       << " seconds" << endl << endl;
+}
+
+//-----------------------------------------------------------------------------
+// Virtual-client sessions
+//-----------------------------------------------------------------------------
+
+enum SessionOp { kSessionPut, kSessionGet, kNumSessionOps };
+static const char *const kSessionOpNames[] = { "PUT", "GET" };
+
+// Operations of a session, parsed from --session_ops.
+static vector<SessionOp> g_session_ops;
+
+static void ParseSessionOps() {
+  istringstream in(FLAGS_session_ops);
+  string op;
+  while (getline(in, op, ',')) {
+    if (op == "put") {
+      g_session_ops.push_back(kSessionPut);
+    } else if (op == "get") {
+      g_session_ops.push_back(kSessionGet);
+    } else {
+      cerr << "ERROR: invalid --session_ops operation '" << op << "'" << endl;
+      exit(1);
+    }
+  }
+  if (g_session_ops.empty()) {
+    cerr << "ERROR: empty --session_ops" << endl;
+    exit(1);
+  }
+}
+
+static int64_t ThinkTimeUs() {
+  thread_local mt19937_64 rng(random_device{}());
+  const double mean_us = FLAGS_think_time_ms * 1000;
+  if (FLAGS_think_time_dist == "fixed" || mean_us <= 0) {
+    return mean_us;
+  }
+  if (FLAGS_think_time_dist == "uniform") {
+    return uniform_real_distribution<double>(0, 2 * mean_us)(rng);
+  }
+  return exponential_distribution<double>(1 / mean_us)(rng);
+}
+
+struct VirtualClient {
+  int id = 0;
+  int sessions_done = 0;
+  size_t next_op = 0;
+  steady_clock::time_point session_start;
+  steady_clock::time_point op_start;
+  // The next operation was charged against the rate limits and the client
+  // was scheduled for the time it may be issued.
+  bool reserved = false;
+};
+
+// Hashed timer wheel with one tick per slot. A timer sits in the slot of its
+// expiry tick modulo the wheel size and fires on the turn that reaches the
+// tick, so both scheduling and expiry are O(1) however many clients think.
+class TimerWheel {
+ public:
+  TimerWheel(microseconds tick, int num_slots)
+  : tick_(tick), slots_(num_slots), start_(steady_clock::now()) {}
+
+  // Thread-safe.
+  void Schedule(steady_clock::time_point when, VirtualClient *vc) {
+    const int64_t tick = (when - start_ + tick_ - nanoseconds(1)) / tick_;
+    unique_lock<mutex> lck(mtx_);
+    const int64_t expiry = max(tick, current_tick_ + 1);
+    slots_[expiry % slots_.size()].push_back({expiry, vc});
+  }
+
+  // Calls fire() for the expired timers outside of the lock until Stop().
+  void Run(const function<void(VirtualClient *)>& fire) {
+    vector<VirtualClient *> due;
+    while (!stop_) {
+      this_thread::sleep_until(start_ + tick_ * (current_tick_ + 1));
+      {
+        unique_lock<mutex> lck(mtx_);
+        const int64_t now_tick = (steady_clock::now() - start_) / tick_;
+        while (current_tick_ < now_tick) {
+          ++current_tick_;
+          vector<Timer>& slot = slots_[current_tick_ % slots_.size()];
+          size_t kept = 0;
+          for (const Timer& timer : slot) {
+            if (timer.expiry <= current_tick_) {
+              due.push_back(timer.vc);
+            } else {
+              slot[kept++] = timer;
+            }
+          }
+          slot.resize(kept);
+        }
+      }
+      for (VirtualClient *vc : due) {
+        fire(vc);
+      }
+      due.clear();
+    }
+  }
+
+  void Stop() { stop_ = true; }
+
+ private:
+  struct Timer {
+    int64_t expiry;
+    VirtualClient *vc;
+  };
+
+  const microseconds tick_;
+  vector<vector<Timer>> slots_;
+  const steady_clock::time_point start_;
+  mutex mtx_;
+  // Written only by Run().
+  int64_t current_tick_ = 0;
+  atomic<bool> stop_{false};
+};
+
+// Session durations and per-operation latencies of the session stage.
+static LatencyHistogram g_session_latency;
+static LatencyHistogram g_session_op_latency[kNumSessionOps];
+
+// Runs --virtual_clients closed-loop clients on one timer wheel thread. Each
+// client thinks, issues the next operation of its session through the async
+// API and thinks again once it completes. The requests of the clients are
+// spread over num_threads S3Clients with a pool of num_connections executor
+// threads each, so the thread count does not grow with the clients.
+static void Sessions() {
+  const LatencyHistogram::Snapshot session0 = g_session_latency.GetSnapshot();
+  LatencyHistogram::Snapshot op0[kNumSessionOps];
+  for (int ii = 0; ii < kNumSessionOps; ++ii) {
+    op0[ii] = g_session_op_latency[ii].GetSnapshot();
+  }
+  const steady_clock::time_point t0 = steady_clock::now();
+
+  TimerWheel wheel(milliseconds(1), 4096);
+  vector<VirtualClient> vcs(FLAGS_virtual_clients);
+  atomic<int> remaining{FLAGS_virtual_clients};
+
+  // Takes a client out of the stage.
+  auto retire = [&]() {
+    if (--remaining == 0) {
+      wheel.Stop();
+    }
+  };
+
+  auto complete = [&](VirtualClient *vc, SessionOp op, int endpoint) {
+    const int64_t latency_us = ElapsedUs(vc->op_start);
+    g_session_op_latency[op].Add(latency_us);
+    RecordCompletion(latency_us, ObjSize());
+    EndEndpointRequest(endpoint, latency_us);
+    if (++vc->next_op == g_session_ops.size()) {
+      g_session_latency.Add(ElapsedUs(vc->session_start));
+      vc->next_op = 0;
+      if (++vc->sessions_done == FLAGS_sessions_per_client) {
+        retire();
+        return;
+      }
+    }
+    if (Stopping()) {
+      retire();
+      return;
+    }
+    wheel.Schedule(steady_clock::now() + microseconds(ThinkTimeUs()), vc);
+  };
+
+  // A request that fails once the program is stopping was cancelled by the
+  // drain, its client leaves the stage.
+  auto abandon = [&](int endpoint) {
+    DropCancelledRequest(endpoint);
+    retire();
+  };
+
+  // Destroyed before the state above, which joins the executor threads.
+  vector<ClientGroup> clients;
+  const int num_clients =
+    FLAGS_client_shards > 0 ? FLAGS_client_shards : FLAGS_num_threads;
+  for (int ii = 0; ii < num_clients; ++ii) {
+    clients.push_back(MakeClientGroup(LocalAddr(ii), true));
+  }
+
+  auto issue = [&](VirtualClient *vc) {
+    if (Stopping()) {
+      if (vc->reserved) {
+        RefundThrottle(ObjSize());
+      }
+      retire();
+      return;
+    }
+    // The wheel thread dispatches all the clients, a throttled client is
+    // scheduled again instead of waiting on it.
+    if (!vc->reserved) {
+      const steady_clock::time_point release = ReserveThrottle(ObjSize());
+      if (release > steady_clock::now()) {
+        vc->reserved = true;
+        wheel.Schedule(release, vc);
+        return;
+      }
+    }
+    vc->reserved = false;
+    const int thread_num = vc->id % FLAGS_num_threads;
+    const int obj_num = vc->id / FLAGS_num_threads % FLAGS_num_objects;
+    const Aws::String key = ObjKey(thread_num, obj_num);
+    const int endpoint = PickEndpoint(key);
+    Aws::S3::S3Client *client =
+      clients[thread_num % clients.size()][endpoint].get();
+    BeginEndpointRequest(endpoint);
+    vc->op_start = steady_clock::now();
+    if (vc->next_op == 0) {
+      vc->session_start = vc->op_start;
+    }
+    if (g_session_ops[vc->next_op] == kSessionPut) {
+      client->PutObjectAsync(
+        PutRequest(thread_num, obj_num),
+        [&complete, &abandon, vc, endpoint](
+          const Aws::S3::S3Client *,
+          const Aws::S3::Model::PutObjectRequest&,
+          const Aws::S3::Model::PutObjectOutcome& outcome,
+          const shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+          if (!outcome.IsSuccess()) {
+            if (Stopping()) {
+              abandon(endpoint);
+              return;
+            }
+            ExitOnError(outcome.GetError());
+          }
+          complete(vc, kSessionPut, endpoint);
+        });
+    } else {
+      client->GetObjectAsync(
+        GetRequest(thread_num, obj_num),
+        [&complete, &abandon, vc, endpoint](
+          const Aws::S3::S3Client *,
+          const Aws::S3::Model::GetObjectRequest&,
+          const Aws::S3::Model::GetObjectOutcome& outcome,
+          const shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+          if (!outcome.IsSuccess() && Stopping()) {
+            abandon(endpoint);
+            return;
+          }
+          CheckGetOutcome(outcome);
+          complete(vc, kSessionGet, endpoint);
+        });
+    }
+  };
+
+  // Start the clients after one think time each, so they do not all arrive
+  // at once.
+  for (int ii = 0; ii < FLAGS_virtual_clients; ++ii) {
+    vcs[ii].id = ii;
+    wheel.Schedule(steady_clock::now() + microseconds(ThinkTimeUs()),
+                   &vcs[ii]);
+  }
+  wheel.Run(issue);
+
+  const double time_sec =
+    duration_cast<duration<double>>(steady_clock::now() - t0).count();
+  const LatencyHistogram::Snapshot sessions =
+    g_session_latency.GetSnapshot() - session0;
+  cout << "SESSION stage sessions: " << sessions.Count() << ", "
+       << (sessions.Count() / time_sec) << " sessions/sec, "
+       << ((double)sessions.Count() * g_session_ops.size() / time_sec /
+           FLAGS_virtual_clients) << " ops/sec per client" << endl
+       << "SESSION stage session duration: " << sessions.Format() << endl;
+  for (int ii = 0; ii < kNumSessionOps; ++ii) {
+    const LatencyHistogram::Snapshot ops =
+      g_session_op_latency[ii].GetSnapshot() - op0[ii];
+    if (ops.Count() > 0) {
+      cout << "SESSION stage " << kSessionOpNames[ii] << " latency ("
+           << ops.Count() << " ops): " << ops.Format() << endl;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Soak testing
+//-----------------------------------------------------------------------------
+
+// Process resources at the end of a soak sample interval, and the workload
+// over the interval.
+struct SoakSample {
+  // Since the start of the soak test.
+  double hours = 0;
+  double rss_mb = 0;
+  double fds = 0;
+  double threads = 0;
+  double connections = 0;
+  double mb_per_sec = 0;
+  double p99_ms = 0;
+};
+
+// The trend of a sampled value flags 'problem' when the value grows, or for
+// 'higher_is_better' drops, by more than --soak_trend_pct over the soak test.
+struct SoakMetric {
+  const char *name;
+  double SoakSample::*value;
+  bool higher_is_better;
+  const char *problem;
+};
+static const SoakMetric kSoakMetrics[] = {
+  {"RSS MB", &SoakSample::rss_mb, false, "LEAK"},
+  {"fds", &SoakSample::fds, false, "LEAK"},
+  {"threads", &SoakSample::threads, false, "LEAK"},
+  {"connections", &SoakSample::connections, false, "LEAK"},
+  {"MB/sec", &SoakSample::mb_per_sec, true, "DECAY"},
+  {"p99 ms", &SoakSample::p99_ms, false, "DECAY"},
+};
+
+// Reads the resident set size and the number of threads of the process.
+static void ReadProcStatus(SoakSample *sample) {
+  ifstream in("/proc/self/status");
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string name;
+    double val = 0;
+    fields >> name >> val;
+    if (name == "VmRSS:") {
+      sample->rss_mb = val / 1024;
+    } else if (name == "Threads:") {
+      sample->threads = val;
+    }
+  }
+}
+
+static int CountOpenFds() {
+  int count = 0;
+  if (DIR *dir = opendir("/proc/self/fd")) {
+    while (const dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        ++count;
+      }
+    }
+    closedir(dir);
+    // The fd of the directory itself.
+    --count;
+  }
+  return count;
+}
+
+// Least squares fit of a metric over the hours of the samples.
+struct SoakTrend {
+  double start = 0;
+  double end = 0;
+  double per_hour = 0;
+  // Change over the soak test relative to the fitted start value.
+  double pct = 0;
+};
+
+static SoakTrend FitSoakTrend(const vector<SoakSample>& samples,
+                              double SoakSample::*value) {
+  const double n = samples.size();
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (const SoakSample& sample : samples) {
+    sum_x += sample.hours;
+    sum_y += sample.*value;
+    sum_xx += sample.hours * sample.hours;
+    sum_xy += sample.hours * sample.*value;
+  }
+  SoakTrend trend;
+  const double denom = n * sum_xx - sum_x * sum_x;
+  if (denom <= 0) {
+    return trend;
+  }
+  trend.per_hour = (n * sum_xy - sum_x * sum_y) / denom;
+  const double intercept = (sum_y - trend.per_hour * sum_x) / n;
+  trend.start = intercept + trend.per_hour * samples.front().hours;
+  trend.end = intercept + trend.per_hour * samples.back().hours;
+  if (trend.start > 0) {
+    trend.pct = 100 * (trend.end - trend.start) / trend.start;
+  }
+  return trend;
+}
+
+// Samples the process every --soak_sample_sec while the soak test runs,
+// fits the trends of the samples, and checkpoints them to --soak_checkpoint
+// after every sample so that a crash loses at most one interval.
+class SoakMonitor {
+ public:
+  SoakMonitor()
+  : start_(steady_clock::now()), start_time_(time(nullptr)),
+    thread_(&SoakMonitor::Run, this) {}
+
+  ~SoakMonitor() {
+    {
+      unique_lock<mutex> lck(mtx_);
+      stop_ = true;
+      cond_.notify_one();
+    }
+    thread_.join();
+    cout << "SOAK summary:" << endl << Summary() << endl;
+    fflush(stdout);
+  }
+
+ private:
+  void Run() {
+    const bool moved_bytes = CountsMovedBytes();
+    steady_clock::time_point prev_t = start_;
+    int64_t prev_bytes = moved_bytes ? MovedBytes() : g_done_bytes.load();
+    LatencyHistogram::Snapshot prev_latency = g_latency.GetSnapshot();
+
+    unique_lock<mutex> lck(mtx_);
+    for (int ii = 1; ; ++ii) {
+      if (cond_.wait_until(lck, start_ + seconds(ii * FLAGS_soak_sample_sec),
+                           [this] { return stop_; })) {
+        return;
+      }
+      const steady_clock::time_point t = steady_clock::now();
+      const int64_t bytes =
+        moved_bytes ? MovedBytes() : g_done_bytes.load();
+      const LatencyHistogram::Snapshot latency = g_latency.GetSnapshot();
+      SoakSample sample;
+      sample.hours = duration_cast<duration<double>>(t - start_).count() /
+        3600;
+      ReadProcStatus(&sample);
+      sample.fds = CountOpenFds();
+      sample.connections = CountOpenConnections();
+      sample.mb_per_sec = (bytes - prev_bytes) / 1048576.0 /
+        duration_cast<duration<double>>(t - prev_t).count();
+      sample.p99_ms = (latency - prev_latency).Percentile(99) / 1000.0;
+      samples_.push_back(sample);
+      prev_t = t;
+      prev_bytes = bytes;
+      prev_latency = latency;
+
+      cout << "SOAK " << sample.hours << "h: RSS " << sample.rss_mb
+           << " MB, fds " << sample.fds << ", threads " << sample.threads
+           << ", connections " << sample.connections << ", "
+           << sample.mb_per_sec << " MB/sec, p99 " << sample.p99_ms << " ms"
+           << endl;
+      if (!FLAGS_soak_checkpoint.empty()) {
+        WriteCheckpoint();
+      }
+    }
+  }
+
+  // Trends of the metrics, without the first sample, which includes the
+  // ramp up of the connections and buffers.
+  string Summary() const {
+    ostringstream out;
+    if (samples_.size() < 4) {
+      out << "  not enough samples for trends: " << samples_.size() << endl;
+      return out.str();
+    }
+    const vector<SoakSample> samples(samples_.begin() + 1, samples_.end());
+    for (const SoakMetric& metric : kSoakMetrics) {
+      const SoakTrend trend = FitSoakTrend(samples, metric.value);
+      const bool worse = metric.higher_is_better ?
+        trend.pct < -FLAGS_soak_trend_pct : trend.pct > FLAGS_soak_trend_pct;
+      out << "  " << metric.name << ": " << trend.start << " -> "
+          << trend.end << " (" << trend.per_hour << "/hour, "
+          << trend.pct << "%)";
+      if (worse) {
+        out << " " << metric.problem;
+      }
+      out << endl;
+    }
+    return out.str();
+  }
+
+  // Writes the summary and the samples through a temporary file, so the
+  // previous checkpoint survives a crash while writing.
+  void WriteCheckpoint() const {
+    const string tmp_path = FLAGS_soak_checkpoint + ".tmp";
+    {
+      ofstream out(tmp_path);
+      char started[32];
+      struct tm tm;
+      localtime_r(&start_time_, &tm);
+      strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", &tm);
+      out << "s3_perf soak test started " << started << ", "
+          << samples_.back().hours << " hours, " << samples_.size()
+          << " samples" << endl
+          << Summary()
+          << "hours rss_mb fds threads connections mb_per_sec p99_ms"
+          << endl;
+      for (const SoakSample& sample : samples_) {
+        out << sample.hours << " " << sample.rss_mb << " " << sample.fds
+            << " " << sample.threads << " " << sample.connections << " "
+            << sample.mb_per_sec << " " << sample.p99_ms << endl;
+      }
+      if (!out) {
+        cerr << "WARNING: cannot write " << tmp_path << endl;
+        return;
+      }
+    }
+    if (rename(tmp_path.c_str(), FLAGS_soak_checkpoint.c_str()) != 0) {
+      cerr << "WARNING: rename " << tmp_path << ": " << strerror(errno)
+           << endl;
+    }
+  }
+
+  const steady_clock::time_point start_;
+  const time_t start_time_;
+  vector<SoakSample> samples_;
+  mutex mtx_;
+  condition_variable cond_;
+  bool stop_{false};
+  thread thread_;
+};
+
+// Repeats the iterations of the upload and download stages until
+// --soak_hours have passed.
+static void Soak() {
+  SoakMonitor monitor;
+  const steady_clock::time_point deadline = steady_clock::now() +
+    duration_cast<steady_clock::duration>(
+      duration<double>(FLAGS_soak_hours * 3600));
+  for (int ii = 1; steady_clock::now() < deadline && !Stopping(); ++ii) {
+    // Presigned again every iteration, the URLs expire after 7 days.
+    if (FLAGS_stage == "all" || FLAGS_stage == "upload") {
+      if (FLAGS_client == "presigned" || FLAGS_client == "event") {
+        PresignUrls(Aws::Http::HttpMethod::HTTP_PUT, "PUT");
+      }
       InitChunk();
       Upload(ii);
     }
-  }
-  if (FLAGS_stage != "upload") {
-    ReportDuration report("DOWNLOAD stage",
-                          FLAGS_num_threads,
-                          FLAGS_num_objects * FLAGS_count,
-                          FLAGS_obj_size_kb);
-    for (int ii = 1; ii <= FLAGS_count; ++ii) {
+    if ((FLAGS_stage == "all" || FLAGS_stage == "download") &&
+        !Stopping()) {
+      if (FLAGS_client == "presigned" || FLAGS_client == "event") {
+        PresignUrls(Aws::Http::HttpMethod::HTTP_GET, "GET");
+      }
       Download(ii);
     }
   }
+}
+
+//-----------------------------------------------------------------------------
+// Stopping on a signal
+//-----------------------------------------------------------------------------
+
+static void OnStopSignal(int sig) {
+  g_stop_signal = sig;
+  // A second signal terminates the program at once.
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  static const char kMessage[] =
+    "\nStopping: draining the requests in flight, signal again to exit\n";
+  const ssize_t ignored = write(STDERR_FILENO, kMessage, sizeof(kMessage) - 1);
+  (void)ignored;
+}
+
+// Once the program is stopping, cancels the requests still in flight after
+// --stop_timeout_sec, and exits with the totals after as long again in case
+// the stages did not finish. Only the requests of the SDK clients can be
+// cancelled, the other drivers finish their transfers.
+static void WatchStop() {
+  while (!Stopping()) {
+    this_thread::sleep_for(milliseconds(100));
+  }
+  const seconds timeout(FLAGS_stop_timeout_sec);
+  this_thread::sleep_for(timeout);
+  const int cancelled = g_in_flight.Cancel(steady_clock::now());
+  if (cancelled > 0) {
+    cout << "Stopping: cancelling " << cancelled << " requests in flight"
+         << endl;
+  }
+  this_thread::sleep_for(timeout);
+  cout << "INTERRUPTED: stages did not finish within "
+       << FLAGS_stop_timeout_sec << " seconds, completed " << g_done_obj
+       << " objects, " << (g_done_bytes / 1048576.0) << " MB, latency: "
+       << g_latency.GetSnapshot().Format() << endl;
+  _exit(128 + g_stop_signal);
+}
+
+int main(int argc, char** argv) {
+  ParseCommandLineFlags(&argc, &argv, false);
+  if (FLAGS_stop_timeout_sec < 0) {
+    cerr << "ERROR: --stop_timeout_sec must not be negative" << endl;
+    exit(1);
+  }
+  signal(SIGINT, OnStopSignal);
+  signal(SIGTERM, OnStopSignal);
+  thread(WatchStop).detach();
+  if (FLAGS_num_outstanding_req <= 0) {
+    FLAGS_num_outstanding_req = FLAGS_num_connections;
+  }
+  if (FLAGS_sys_stats && FLAGS_report_interval_sec <= 0) {
+    FLAGS_report_interval_sec = 1;
+  }
+
+  Aws::SDKOptions options;
+  //options.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Trace;
+  if (FLAGS_sdk_allocator != "default" && FLAGS_sdk_allocator != "pool") {
+    cerr << "ERROR: invalid --sdk_allocator " << FLAGS_sdk_allocator << endl;
+    exit(1);
+  }
+#ifndef USE_AWS_MEMORY_MANAGEMENT
+  if (FLAGS_sdk_allocator == "pool" || FLAGS_alloc_profile) {
+    cerr << "ERROR: --sdk_allocator=pool and --alloc_profile require an SDK "
+         << "built with -DCUSTOM_MEMORY_MANAGEMENT=ON" << endl;
+    exit(1);
+  }
+#endif
+  // The memory managers are never freed, the SDK may release memory until
+  // the very end.
+  if (FLAGS_sdk_allocator == "pool") {
+    g_pool_mem = new PoolMemorySystem();
+    options.memoryManagementOptions.memoryManager = g_pool_mem;
+  }
+  if (FLAGS_alloc_profile) {
+    g_alloc_counter = new CountingMemorySystem(g_pool_mem);
+    options.memoryManagementOptions.memoryManager = g_alloc_counter;
+  }
+#ifndef S3_PERF_IO_URING
+  if (FLAGS_http_client == "io_uring") {
+    cerr << "ERROR: --http_client=io_uring requires a build with IO_URING=1"
+         << endl;
+    exit(1);
+  }
+#endif
+  if (FLAGS_client != "s3" && FLAGS_client != "presigned" &&
+      FLAGS_client != "crt" && FLAGS_client != "transfer" &&
+      FLAGS_client != "event") {
+    cerr << "ERROR: invalid --client " << FLAGS_client << endl;
+    exit(1);
+  }
+  if (FLAGS_stage != "all" && FLAGS_stage != "upload" &&
+      FLAGS_stage != "download" && FLAGS_stage != "session" &&
+      FLAGS_stage != "populate") {
+    cerr << "ERROR: invalid --stage " << FLAGS_stage << endl;
+    exit(1);
+  }
+  if (FLAGS_soak_hours > 0) {
+    if (FLAGS_stage != "all" && FLAGS_stage != "upload" &&
+        FLAGS_stage != "download") {
+      cerr << "ERROR: --soak_hours requires --stage=all, upload or download"
+           << endl;
+      exit(1);
+    }
+    if (FLAGS_soak_sample_sec <= 0) {
+      cerr << "ERROR: invalid --soak_sample_sec " << FLAGS_soak_sample_sec
+           << endl;
+      exit(1);
+    }
+  }
+  if (FLAGS_stage == "populate" && FLAGS_manifest.empty()) {
+    cerr << "ERROR: --stage=populate requires --manifest" << endl;
+    exit(1);
+  }
+  if (!FLAGS_manifest.empty() && FLAGS_stage != "populate" &&
+      FLAGS_stage != "download") {
+    cerr << "ERROR: --manifest requires --stage=populate or download"
+         << endl;
+    exit(1);
+  }
+  if (FLAGS_stage == "session" && FLAGS_virtual_clients <= 0) {
+    cerr << "ERROR: --stage=session requires --virtual_clients" << endl;
+    exit(1);
+  }
+  if (FLAGS_virtual_clients > 0) {
+    if (FLAGS_client != "s3" || FLAGS_api != "async") {
+      cerr << "ERROR: --virtual_clients requires --client=s3 --api=async"
+           << endl;
+      exit(1);
+    }
+    if (FLAGS_think_time_dist != "fixed" &&
+        FLAGS_think_time_dist != "uniform" &&
+        FLAGS_think_time_dist != "exp") {
+      cerr << "ERROR: invalid --think_time_dist " << FLAGS_think_time_dist
+           << endl;
+      exit(1);
+    }
+    ParseSessionOps();
+  }
+  if (FLAGS_admission == "global") {
+    if (!UsesCtx()) {
+      cerr << "ERROR: --admission=global requires --api=async with "
+           << "--client=s3, crt or transfer" << endl;
+      exit(1);
+    }
+    if (FLAGS_max_in_flight <= 0) {
+      FLAGS_max_in_flight = FLAGS_num_threads * FLAGS_num_outstanding_req;
+    }
+    g_admission.reset(new AdmissionController(FLAGS_max_in_flight));
+  } else if (FLAGS_admission != "thread") {
+    cerr << "ERROR: invalid --admission " << FLAGS_admission << endl;
+    exit(1);
+  }
+  g_thread_in_flight.resize(FLAGS_num_threads);
+  if (FLAGS_key_scheme != "flat" && FLAGS_key_scheme != "hash" &&
+      FLAGS_key_scheme != "prefixes" && FLAGS_key_scheme != "date") {
+    cerr << "ERROR: invalid --key_scheme " << FLAGS_key_scheme << endl;
+    exit(1);
+  }
+  if (FLAGS_key_scheme == "hash" && FLAGS_num_prefixes > 0x10000) {
+    cerr << "ERROR: --key_scheme=hash supports at most 65536 prefixes"
+         << endl;
+    exit(1);
+  }
+  InitEndpoints();
+  {
+    istringstream in(FLAGS_local_addrs);
+    string addr;
+    while (getline(in, addr, ',')) {
+      g_local_addrs.push_back(addr);
+    }
+    if (!g_local_addrs.empty() && FLAGS_client == "crt") {
+      cerr << "ERROR: --local_addrs is not supported with --client=crt"
+           << endl;
+      exit(1);
+    }
+    InitLocalAddrIfaces();
+  }
+  if (g_endpoints.size() > 1 && FLAGS_client != "s3") {
+    cerr << "ERROR: multiple endpoints require --client=s3" << endl;
+    exit(1);
+  }
+  if (FLAGS_lb_policy != "round_robin" &&
+      FLAGS_lb_policy != "least_outstanding" &&
+      FLAGS_lb_policy != "key_hash") {
+    cerr << "ERROR: invalid --lb_policy " << FLAGS_lb_policy << endl;
+    exit(1);
+  }
+  if (FLAGS_read_after_write && FLAGS_client != "s3") {
+    cerr << "ERROR: --read_after_write requires --client=s3" << endl;
+    exit(1);
+  }
+  if (FLAGS_client_shards > 0 && FLAGS_client != "s3") {
+    cerr << "ERROR: --client_shards requires --client=s3" << endl;
+    exit(1);
+  }
+  if (FLAGS_prewarm && FLAGS_client != "s3") {
+    cerr << "ERROR: --prewarm requires --client=s3" << endl;
+    exit(1);
+  }
+  if (FLAGS_api != "async" && FLAGS_api != "sync") {
+    cerr << "ERROR: invalid --api " << FLAGS_api << endl;
+    exit(1);
+  }
+  if (FLAGS_api == "sync" && FLAGS_client != "s3") {
+    cerr << "ERROR: --api=sync requires --client=s3" << endl;
+    exit(1);
+  }
+  if (FLAGS_client == "event") {
+    if (FLAGS_scheme != "http") {
+      cerr << "ERROR: --client=event requires --scheme=http" << endl;
+      exit(1);
+    }
+    // Every slot holds a socket.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+#ifndef S3_PERF_CRT
+  if (FLAGS_client == "crt") {
+    cerr << "ERROR: --client=crt requires a build with CRT=1" << endl;
+    exit(1);
+  }
+#endif
+#ifndef S3_PERF_TRANSFER
+  if (FLAGS_client == "transfer") {
+    cerr << "ERROR: --client=transfer requires a build with TRANSFER=1"
+         << endl;
+    exit(1);
+  }
+#endif
+  if (FLAGS_http_client != "curl" && FLAGS_http_client != "io_uring") {
+    cerr << "ERROR: invalid --http_client " << FLAGS_http_client << endl;
+    exit(1);
+  }
+  if (FLAGS_http_client == "io_uring" && FLAGS_scheme != "http") {
+    cerr << "ERROR: --http_client=io_uring requires --scheme=http" << endl;
+    exit(1);
+  }
+  if (FLAGS_rate_limit_ops > 0 || FLAGS_rate_limit_mbps > 0) {
+    g_rate_limiter.reset(new RateLimiter());
+  }
+  {
+    // Rejects socket options the kernel does not accept before any stage.
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      cerr << "ERROR: socket: " << strerror(errno) << endl;
+      exit(1);
+    }
+    const char *failed = "";
+    if (const int err = TuneSocket(fd, &failed)) {
+      cerr << "ERROR: " << failed << ": " << strerror(err) << endl;
+      exit(1);
+    }
+    close(fd);
+    g_tuned_sockets = 0;
+  }
+  options.httpOptions.httpClientFactory_create_fn = [] {
+    return Aws::MakeShared<BenchHttpClientFactory>("s3_perf");
+  };
+  Aws::InitAPI(options);
+
+  InitKeyScheme();
+  if (!FLAGS_manifest.empty()) {
+    InitManifest();
+  }
+  InitPartitionStats();
+  PrintVars();
+  InitPageBuffers();
+  if (FLAGS_client == "s3") {
+    for (int ii = 0; ii < FLAGS_client_shards; ++ii) {
+      g_s3_clients.push_back(MakeClientGroup(LocalAddr(ii)));
+    }
+  }
+
+  if (FLAGS_stage == "populate") {
+    Populate();
+  }
+  if (FLAGS_soak_hours > 0) {
+    Soak();
+  } else {
+    if (FLAGS_stage == "all" || FLAGS_stage == "upload") {
+      if (FLAGS_client == "presigned" || FLAGS_client == "event") {
+        PresignUrls(Aws::Http::HttpMethod::HTTP_PUT, "PUT");
+      }
+      ReportDuration report("UPLOAD stage",
+                            FLAGS_num_threads,
+                            FLAGS_num_objects * FLAGS_count,
+                            FLAGS_obj_size_kb);
+      for (int ii = 1; ii <= FLAGS_count && !Stopping(); ++ii) {
+        InitChunk();
+        Upload(ii);
+      }
+    }
+    // The stages after an interrupted one are skipped.
+    if ((FLAGS_stage == "all" || FLAGS_stage == "session") &&
+        FLAGS_virtual_clients > 0 && !Stopping()) {
+      ReportDuration report("SESSION stage",
+                            FLAGS_virtual_clients,
+                            FLAGS_sessions_per_client * g_session_ops.size(),
+                            FLAGS_obj_size_kb);
+      IntervalReporter interval_report("SESSION");
+      ConnectionSampler connection_sampler("SESSION stage");
+      InterfaceReport interface_report("SESSION stage");
+      StallWatchdog stall_watchdog("SESSION stage");
+      InitChunk();
+      Sessions();
+    }
+    if ((FLAGS_stage == "all" || FLAGS_stage == "download") &&
+        !Stopping()) {
+      if (FLAGS_client == "presigned" || FLAGS_client == "event") {
+        PresignUrls(Aws::Http::HttpMethod::HTTP_GET, "GET");
+      }
+      ReportDuration report("DOWNLOAD stage",
+                            FLAGS_num_threads,
+                            FLAGS_num_objects * FLAGS_count,
+                            FLAGS_obj_size_kb);
+      for (int ii = 1; ii <= FLAGS_count && !Stopping(); ++ii) {
+        Download(ii);
+      }
+    }
+  }
 
+  PrintAllocStats();
+
+  g_s3_clients.clear();
   Aws::ShutdownAPI(options);
-  return 0;
+  return Stopping() ? 128 + g_stop_signal : 0;
 }